@@ -67,11 +67,19 @@ function runExecutable(jobId, exeName, inputDir, outputDir, filterType) {
   });
 }
 
+/**
+ * MPI_LAUNCH=numa starts one rank per NUMA domain, bound to that domain's cores,
+ * and the engine threads each rank across them with OpenMP; the default is four
+ * ranks sharing the machine's cores.
+ */
 function runMPI(jobId, exeName, inputDir, outputDir, filterType) {
       const exePath = path.join(binDir, exeName);
-      const args = ['-n', '4', exePath, inputDir, outputDir, filterType];
+      const launch = process.env.MPI_LAUNCH === 'numa'
+        ? ['--map-by', 'ppr:1:numa', '--bind-to', 'numa']
+        : ['-n', '4'];
+      const args = [...launch, exePath, inputDir, outputDir, filterType];
 
-      console.log(`[Job ${jobId}] Running: mpirun ${args.slice(0,2).join(' ')} ${exePath} ${[inputDir, outputDir, filterType].join(' ')}`);
+      console.log(`[Job ${jobId}] Running: mpirun ${launch.join(' ')} ${exePath} ${[inputDir, outputDir, filterType].join(' ')}`);
 
       return new Promise((resolve, reject) => {
         execFile('mpirun', args, (error, stdout, stderr) => {
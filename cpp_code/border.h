@@ -0,0 +1,69 @@
+#ifndef BORDER_H
+#define BORDER_H
+
+#include <cstddef>
+#include <string>
+
+// Border policies for the stencil kernels. map(i, n) takes any coordinate and
+// returns the in-range index to read instead, or -1 for "use the constant 0".
+// Kernels only call it inside the thin strips near the image edges; the interior
+// reads pixels directly.
+
+enum class BorderMode { Clamp, Reflect, Wrap, Constant };
+
+struct BorderClamp {
+    static int map(int i, int n) { return i < 0 ? 0 : (i >= n ? n - 1 : i); }
+};
+
+// Mirror around the edge pixel without repeating it: -1 -> 1, n -> n - 2.
+struct BorderReflect {
+    static int map(int i, int n) {
+        if (n == 1) return 0;
+        const int period = 2 * (n - 1);
+        i %= period;
+        if (i < 0) i += period;
+        return i < n ? i : period - i;
+    }
+};
+
+struct BorderWrap {
+    static int map(int i, int n) {
+        i %= n;
+        return i < 0 ? i + n : i;
+    }
+};
+
+struct BorderConstant {
+    static int map(int i, int n) { return i < 0 || i >= n ? -1 : i; }
+};
+
+inline bool parse_border_mode(const std::string& name, BorderMode& mode) {
+    if (name == "clamp") mode = BorderMode::Clamp;
+    else if (name == "reflect") mode = BorderMode::Reflect;
+    else if (name == "wrap") mode = BorderMode::Wrap;
+    else if (name == "constant") mode = BorderMode::Constant;
+    else return false;
+    return true;
+}
+
+// Calls f(Policy{}) with the policy type for a runtime BorderMode.
+template <typename F>
+void dispatch_border(BorderMode mode, F&& f) {
+    switch (mode) {
+        case BorderMode::Reflect: f(BorderReflect{}); break;
+        case BorderMode::Wrap: f(BorderWrap{}); break;
+        case BorderMode::Constant: f(BorderConstant{}); break;
+        default: f(BorderClamp{}); break;
+    }
+}
+
+// Row y of an h-row image with the given stride (in elements), resolving rows
+// outside the image with Border. zero_row must hold at least `stride` zeros.
+template <class Border, typename T>
+inline const T* border_row(const T* img, size_t stride, int h, int y, const T* zero_row) {
+    if (y >= 0 && y < h) return img + (size_t)y * stride;
+    int m = Border::map(y, h);
+    return m < 0 ? zero_row : img + (size_t)m * stride;
+}
+
+#endif
@@ -0,0 +1,234 @@
+#ifndef CONVOLVE_H
+#define CONVOLVE_H
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "border.h"
+#include "fft.h"
+#include "filters.h"
+
+// Convolution with a user kernel (--kernel=<file>). Small kernels run as a direct
+// sliding window; large ones run tile by tile in the frequency domain, where the
+// cost per pixel grows with log(K) instead of K^2.
+
+// --conv-impl=auto switches to the FFT path above about 31x31 taps.
+constexpr int FFT_MIN_TAPS = 31 * 31;
+constexpr int MAX_CONV_KERNEL_SIZE = 1023;
+
+struct ConvKernel {
+    int w = 0, h = 0;
+    std::vector<float> taps;     // h x w, row-major, as written in the file
+    std::vector<float> flipped;  // taps rotated 180 degrees: the order a sliding window reads them in
+
+    int radius_x() const { return w / 2; }
+    int radius_y() const { return h / 2; }
+};
+
+// Text file with one kernel row per line and the weights separated by spaces or
+// commas; '#' starts a comment and blank lines are skipped. Both dimensions must
+// be odd so the centre tap lands on the output pixel. Weights are used as given,
+// not normalized.
+inline ConvKernel load_conv_kernel(const std::string& path) {
+    std::ifstream f(path);
+    if (!f) throw std::runtime_error("Cannot open kernel file " + path);
+    ConvKernel k;
+    std::string line;
+    while (std::getline(f, line)) {
+        line = line.substr(0, line.find('#'));
+        std::replace(line.begin(), line.end(), ',', ' ');
+        std::istringstream ss(line);
+        std::vector<float> row;
+        std::string tok;
+        while (ss >> tok) {
+            size_t used = 0;
+            float v = 0.0f;
+            try { v = std::stof(tok, &used); } catch (const std::exception&) { used = 0; }
+            if (used == 0 || used != tok.size()) throw std::runtime_error(path + ": not a number: " + tok);
+            row.push_back(v);
+        }
+        if (row.empty()) continue;
+        if (k.h == 0) k.w = (int)row.size();
+        else if ((int)row.size() != k.w)
+            throw std::runtime_error(path + ": row " + std::to_string(k.h + 1) + " has " + std::to_string(row.size()) +
+                                     " weights, expected " + std::to_string(k.w));
+        k.taps.insert(k.taps.end(), row.begin(), row.end());
+        ++k.h;
+    }
+    if (k.h == 0) throw std::runtime_error(path + ": kernel is empty");
+    if (k.w % 2 == 0 || k.h % 2 == 0)
+        throw std::runtime_error(path + ": kernel must have odd width and height, got " +
+                                 std::to_string(k.w) + "x" + std::to_string(k.h));
+    if (k.w > MAX_CONV_KERNEL_SIZE || k.h > MAX_CONV_KERNEL_SIZE)
+        throw std::runtime_error(path + ": kernel is larger than " + std::to_string(MAX_CONV_KERNEL_SIZE) +
+                                 " taps per side");
+    k.flipped.assign(k.taps.rbegin(), k.taps.rend());
+    return k;
+}
+
+// Columns [x0, x1) of one row whose taps are all inside the row; dst points at
+// column x0. C fixes the channel count as in gaussian_direct_span.
+template <int C>
+void convolve_direct_span(const unsigned char* const* src, unsigned char* dst, int x0, int x1, int c,
+                          const ConvKernel& k, bool round_nearest)
+{
+    constexpr int MAX_C = C > 0 ? C : 4;
+    const int nc = C > 0 ? C : c;
+    const int rx = k.radius_x();
+    for (int x = x0; x < x1; ++x) {
+        float acc[MAX_C] = {};
+        for (int ky = 0; ky < k.h; ++ky) {
+            const unsigned char* p = src[ky] + (size_t)(x - rx) * nc;
+            const float* wrow = k.flipped.data() + (size_t)ky * k.w;
+            for (int kx = 0; kx < k.w; ++kx) {
+                #pragma GCC unroll 4
+                for (int ch = 0; ch < nc; ++ch) acc[ch] += wrow[kx] * p[kx * nc + ch];
+            }
+        }
+        for (int ch = 0; ch < nc; ++ch) dst[(size_t)(x - x0) * nc + ch] = to_uc(acc[ch], round_nearest);
+    }
+}
+
+// Direct convolution of full-width rows [y0, y1) into out (pointing at row y0),
+// with row(y) resolving rows outside the image as in gaussian_direct_rows.
+template <class Border = BorderClamp, typename RowFn>
+void convolve_direct_rows(const RowFn& row, unsigned char* out, int w, int c, int y0, int y1,
+                          const ConvKernel& k, bool round_nearest)
+{
+    const int rx = k.radius_x(), ry = k.radius_y();
+    const int a = std::min(rx, w), b = std::max(w - rx, a);
+    std::vector<const unsigned char*> src(k.h);
+
+    for (int y = y0; y < y1; ++y) {
+        for (int j = 0; j < k.h; ++j) src[j] = row(y - ry + j);
+        unsigned char* dst = out + (size_t)(y - y0) * w * c;
+
+        auto border_pixel = [&](int x) {
+            for (int ch = 0; ch < c; ++ch) {
+                float acc = 0.0f;
+                for (int ky = 0; ky < k.h; ++ky)
+                    for (int kx = 0; kx < k.w; ++kx) {
+                        int nx = Border::map(x - rx + kx, w);
+                        if (nx >= 0) acc += k.flipped[(size_t)ky * k.w + kx] * src[ky][(size_t)nx * c + ch];
+                    }
+                dst[(size_t)x * c + ch] = to_uc(acc, round_nearest);
+            }
+        };
+
+        for (int x = 0; x < a; ++x) border_pixel(x);
+        unsigned char* mid = dst + (size_t)a * c;
+        if (c == 3) convolve_direct_span<3>(src.data(), mid, a, b, 3, k, round_nearest);
+        else if (c == 1) convolve_direct_span<1>(src.data(), mid, a, b, 1, k, round_nearest);
+        else convolve_direct_span<0>(src.data(), mid, a, b, c, k, round_nearest);
+        for (int x = b; x < w; ++x) border_pixel(x);
+    }
+}
+
+// Transform length along one axis for a kernel of k taps: about four kernel widths,
+// so three quarters of every transform is output, but no longer than the image
+// extent plus halo needs.
+inline int fft_conv_size(int k, int extent) {
+    int n = next_pow2(4 * k);
+    n = std::min(n, std::max(1024, next_pow2(2 * k)));
+    return std::min(n, next_pow2(extent + k - 1));
+}
+
+// Everything the FFT tiles of one image share. Each tile covers tile_w x tile_h
+// output pixels and reads that area plus the kernel radius on every side, which
+// fills an nx x ny transform; the circular wrap-around only lands in the halo.
+struct FftConvPlan {
+    int nx = 0, ny = 0;
+    int tile_w = 0, tile_h = 0;
+    int rx = 0, ry = 0;
+    FftPlan row_plan, col_plan;
+    std::vector<cfloat> spectrum;  // kernel transform, scaled by 1 / (nx * ny)
+};
+
+inline FftConvPlan make_fft_conv_plan(const ConvKernel& k, int w, int h) {
+    FftConvPlan p;
+    p.nx = fft_conv_size(k.w, w);
+    p.ny = fft_conv_size(k.h, h);
+    p.tile_w = p.nx - k.w + 1;
+    p.tile_h = p.ny - k.h + 1;
+    p.rx = k.radius_x();
+    p.ry = k.radius_y();
+    p.row_plan = make_fft_plan(p.nx);
+    p.col_plan = p.ny == p.nx ? p.row_plan : make_fft_plan(p.ny);
+
+    const float scale = 1.0f / ((float)p.nx * p.ny);
+    p.spectrum.assign((size_t)p.nx * p.ny, cfloat());
+    for (int j = 0; j < k.h; ++j) {
+        cfloat* r = p.spectrum.data() + (size_t)j * p.nx;
+        for (int i = 0; i < k.w; ++i) r[i] = cfloat(k.taps[(size_t)j * k.w + i] * scale, 0.0f);
+        fft(r, p.row_plan, false);
+    }
+    std::vector<cfloat> col;
+    fft_columns(p.spectrum.data(), p.nx, p.col_plan, false, col);
+    return p;
+}
+
+// Per-thread buffers for convolve_fft_tile.
+struct FftConvScratch {
+    std::vector<unsigned char> tile;
+    std::vector<cfloat> buf, col;
+};
+
+// Output pixels [x0, x0 + tile_w) x [y0, y0 + tile_h), clipped to the image, of
+// the convolution of in with the plan's kernel, written into the full-size out.
+// Channels go through the transform two at a time as the real and imaginary
+// parts of one complex signal: the kernel is real, so the two results come back
+// separated the same way and three channels cost two transforms, not three.
+template <class Border>
+void convolve_fft_tile(const unsigned char* in, int w, int h, int c, int x0, int y0,
+                       const FftConvPlan& p, bool round_nearest, unsigned char* out, FftConvScratch& s)
+{
+    const int x1 = std::min(x0 + p.tile_w, w), y1 = std::min(y0 + p.tile_h, h);
+    const int halo = std::max(p.rx, p.ry);
+    load_haloed_tile<Border>(in, w, h, c, x0, x1, y0, y1, halo, s.tile);
+    const size_t tile_row = (size_t)(x1 - x0 + 2 * halo) * c;
+    const int cols = x1 - x0 + 2 * p.rx, rows = y1 - y0 + 2 * p.ry;
+    const size_t nx = p.nx;
+    s.buf.resize(nx * p.ny);
+
+    for (int ch = 0; ch < c; ch += 2) {
+        const bool pair = ch + 1 < c;
+        // Rows past the input are zero and stay zero through the row transforms.
+        for (int j = 0; j < rows; ++j) {
+            const unsigned char* src = s.tile.data() + (size_t)(j + halo - p.ry) * tile_row + (size_t)(halo - p.rx) * c;
+            cfloat* dst = s.buf.data() + (size_t)j * nx;
+            for (int i = 0; i < cols; ++i)
+                dst[i] = cfloat(src[(size_t)i * c + ch], pair ? src[(size_t)i * c + ch + 1] : 0);
+            std::fill(dst + cols, dst + nx, cfloat());
+            fft(dst, p.row_plan, false);
+        }
+        std::fill(s.buf.begin() + (size_t)rows * nx, s.buf.end(), cfloat());
+        fft_columns(s.buf.data(), p.nx, p.col_plan, false, s.col);
+
+        for (size_t i = 0; i < s.buf.size(); ++i) {
+            const cfloat a = s.buf[i], b = p.spectrum[i];
+            s.buf[i] = cfloat(a.real() * b.real() - a.imag() * b.imag(), a.real() * b.imag() + a.imag() * b.real());
+        }
+
+        // Only the rows that hold output need the inverse row transform. Float round-off
+        // leaves results around 1e-4 off, so exact integers (a shift or identity kernel)
+        // can land just below themselves; the slack keeps truncation from dropping a level.
+        const float slack = round_nearest ? 0.0f : 1e-3f;
+        fft_columns(s.buf.data(), p.nx, p.col_plan, true, s.col);
+        for (int y = y0; y < y1; ++y) {
+            cfloat* r = s.buf.data() + (size_t)(y - y0 + 2 * p.ry) * nx;
+            fft(r, p.row_plan, true);
+            unsigned char* dst = out + ((size_t)y * w + x0) * c;
+            for (int x = 0; x < x1 - x0; ++x) {
+                const cfloat v = r[x + 2 * p.rx];
+                dst[(size_t)x * c + ch] = to_uc(v.real() + slack, round_nearest);
+                if (pair) dst[(size_t)x * c + ch + 1] = to_uc(v.imag() + slack, round_nearest);
+            }
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,91 @@
+#ifndef FFT_H
+#define FFT_H
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <cstddef>
+#include <vector>
+
+// Iterative radix-2 FFT for the frequency-domain convolution in convolve.h.
+// Transforms are unnormalized in both directions; callers fold 1/n into
+// whichever side is cheaper. Complex products are written out by hand because
+// std::complex's operator* goes through a NaN-checking library call at -O2.
+
+using cfloat = std::complex<float>;
+
+inline int next_pow2(int n) {
+    int p = 1;
+    while (p < n) p <<= 1;
+    return p;
+}
+
+// Bit-reversal permutation and twiddles exp(-2*pi*i*k/n), k < n/2, for one size.
+struct FftPlan {
+    int n = 0;
+    std::vector<int> bitrev;
+    std::vector<cfloat> twiddle;
+};
+
+// n must be a power of two.
+inline FftPlan make_fft_plan(int n) {
+    FftPlan plan;
+    plan.n = n;
+    plan.bitrev.resize(n);
+    int bits = 0;
+    while ((1 << bits) < n) ++bits;
+    for (int i = 0; i < n; ++i) {
+        int r = 0;
+        for (int b = 0; b < bits; ++b) r |= ((i >> b) & 1) << (bits - 1 - b);
+        plan.bitrev[i] = r;
+    }
+    plan.twiddle.resize(n / 2);
+    for (int k = 0; k < n / 2; ++k) {
+        const double a = -2.0 * M_PI * k / n;
+        plan.twiddle[k] = cfloat((float)std::cos(a), (float)std::sin(a));
+    }
+    return plan;
+}
+
+// In-place transform of plan.n contiguous points; inverse uses the conjugate twiddles.
+inline void fft(cfloat* a, const FftPlan& plan, bool inverse) {
+    const int n = plan.n;
+    for (int i = 0; i < n; ++i) {
+        const int j = plan.bitrev[i];
+        if (i < j) std::swap(a[i], a[j]);
+    }
+    const float sign = inverse ? -1.0f : 1.0f;
+    for (int len = 2; len <= n; len <<= 1) {
+        const int half = len / 2, step = n / len;
+        for (int i = 0; i < n; i += len) {
+            for (int j = 0; j < half; ++j) {
+                const cfloat w = plan.twiddle[(size_t)j * step];
+                const float wr = w.real(), wi = sign * w.imag();
+                const cfloat x = a[i + j + half];
+                const cfloat v(x.real() * wr - x.imag() * wi, x.real() * wi + x.imag() * wr);
+                const cfloat u = a[i + j];
+                a[i + j] = cfloat(u.real() + v.real(), u.imag() + v.imag());
+                a[i + j + half] = cfloat(u.real() - v.real(), u.imag() - v.imag());
+            }
+        }
+    }
+}
+
+// Transforms the columns of a row-major plan.n x cols buffer. Columns are copied
+// out eight at a time (one cache line of each row) so the butterflies run on
+// contiguous memory.
+inline void fft_columns(cfloat* a, int cols, const FftPlan& plan, bool inverse, std::vector<cfloat>& col) {
+    constexpr int BLOCK = 8;
+    const int n = plan.n;
+    col.resize((size_t)n * BLOCK);
+    for (int x0 = 0; x0 < cols; x0 += BLOCK) {
+        const int nb = std::min(BLOCK, cols - x0);
+        for (int y = 0; y < n; ++y)
+            for (int b = 0; b < nb; ++b) col[(size_t)b * n + y] = a[(size_t)y * cols + x0 + b];
+        for (int b = 0; b < nb; ++b) fft(col.data() + (size_t)b * n, plan, inverse);
+        for (int y = 0; y < n; ++y)
+            for (int b = 0; b < nb; ++b) a[(size_t)y * cols + x0 + b] = col[(size_t)b * n + y];
+    }
+}
+
+#endif
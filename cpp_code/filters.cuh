@@ -18,7 +18,9 @@ __global__ void grayscale_kernel(const unsigned char* input, unsigned char* outp
 }
 
 
-__constant__ float GAUSSIAN_KERNEL[9*9];
+// Sized for the largest radius the GPU engine accepts (31 x 31 taps, 3.8 KB).
+#define GAUSSIAN_MAX_RADIUS 15
+__constant__ float GAUSSIAN_KERNEL[(2 * GAUSSIAN_MAX_RADIUS + 1) * (2 * GAUSSIAN_MAX_RADIUS + 1)];
 
 __global__ void gaussian_blur_kernel_color(const unsigned char* input,
                                            unsigned char* output,
@@ -53,6 +55,41 @@ __global__ void gaussian_blur_kernel_color(const unsigned char* input,
     output[outIdx + 2] = static_cast<unsigned char>(min(max(b_sum, 0.0f), 255.0f));
 }
 
+// Same filter with the radius fixed at compile time so both tap loops unroll.
+template <int R>
+__global__ void gaussian_blur_kernel_color_r(const unsigned char* input,
+                                             unsigned char* output,
+                                             int width, int height, int channels)
+{
+    int x = blockIdx.x * blockDim.x + threadIdx.x;
+    int y = blockIdx.y * blockDim.y + threadIdx.y;
+    if (x >= width || y >= height) return;
+
+    constexpr int K = 2 * R + 1;
+    float r_sum = 0.0f, g_sum = 0.0f, b_sum = 0.0f;
+
+    #pragma unroll
+    for (int ky = -R; ky <= R; ++ky) {
+        int ny = min(max(y + ky, 0), height - 1);
+        #pragma unroll
+        for (int kx = -R; kx <= R; ++kx) {
+            int nx = min(max(x + kx, 0), width - 1);
+            int nIdx = (ny * width + nx) * channels;
+
+            float k = GAUSSIAN_KERNEL[(ky + R) * K + (kx + R)];
+
+            r_sum += k * input[nIdx];
+            g_sum += k * input[nIdx + 1];
+            b_sum += k * input[nIdx + 2];
+        }
+    }
+
+    int outIdx = (y * width + x) * channels;
+    output[outIdx]     = static_cast<unsigned char>(min(max(r_sum, 0.0f), 255.0f));
+    output[outIdx + 1] = static_cast<unsigned char>(min(max(g_sum, 0.0f), 255.0f));
+    output[outIdx + 2] = static_cast<unsigned char>(min(max(b_sum, 0.0f), 255.0f));
+}
+
 
 
 __constant__ float SOBEL_X[9];
@@ -0,0 +1,350 @@
+#ifndef FILTERS_H
+#define FILTERS_H
+
+#include <vector>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+#include "border.h"
+#include "gaussian.h"
+
+// CPU counterparts of the kernels in filters.cuh. Every function here works on a
+// range of output rows (or a tile) and is single-threaded; the engines decide how
+// to split the image between threads (OpenMP) or ranks (MPI).
+
+inline unsigned char to_uc(float v, bool round_nearest) {
+    if (round_nearest) v += 0.5f;
+    return static_cast<unsigned char>(std::min(std::max(v, 0.0f), 255.0f));
+}
+
+// Per-thread row buffers for gaussian_separable_tile.
+struct SeparableScratch {
+    std::vector<float> vbuf;  // vertical pass result, padded by `half` pixels on both sides
+    std::vector<float> hbuf;  // horizontal pass accumulator
+};
+
+// Separable Gaussian for output columns [x0, x1) of rows [y0, y1). row(y) returns
+// the w-pixel input row for any y in [y0 - half, y1 + half), with the caller
+// resolving rows outside the image (border_row); columns outside the row are
+// resolved with Border. out points at output pixel (x0, y0), rows out_stride apart.
+// The vertical pass folds K input rows into one float row, the horizontal pass then
+// runs K taps over that row, so a pixel costs 2K multiply-adds instead of K * K.
+// With R >= 0 the radius is a compile-time constant and both tap loops unroll
+// (see dispatch_radius); R == -1 reads it from k_size at runtime.
+template <int R = -1, class Border = BorderClamp, typename RowFn>
+void gaussian_separable_tile(const RowFn& row, int w, int c, int x0, int x1, int y0, int y1,
+                             const float* k1d, int k_size, bool round_nearest,
+                             unsigned char* out, size_t out_stride, SeparableScratch& s)
+{
+    const int half = R >= 0 ? R : k_size / 2;
+    const int taps = 2 * half + 1;
+    const size_t span = (size_t)(x1 - x0) * c;
+    const size_t pad = (size_t)half * c;
+    s.vbuf.resize(span + 2 * pad);
+    s.hbuf.resize(span);
+    float* vb = s.vbuf.data() + pad;  // vb[i] is element x0 * c + i of the row
+    float* hb = s.hbuf.data();
+
+    // The vertical pass covers the output columns plus whatever padding lies inside the row.
+    const int v0 = std::max(x0 - half, 0), v1 = std::min(x1 + half, w);
+    float* vdst = vb + (ptrdiff_t)(v0 - x0) * c;
+    const size_t v_len = (size_t)(v1 - v0) * c;
+
+    for (int y = y0; y < y1; ++y) {
+        if constexpr (R >= 0) {
+            const unsigned char* src[2 * R + 1];
+            for (int k = 0; k < taps; ++k) src[k] = row(y - half + k) + (size_t)v0 * c;
+            for (size_t i = 0; i < v_len; ++i) {
+                float acc = 0.0f;
+                for (int k = 0; k < 2 * R + 1; ++k) acc += k1d[k] * src[k][i];
+                vdst[i] = acc;
+            }
+        } else {
+            std::fill(vdst, vdst + v_len, 0.0f);
+            for (int k = 0; k < taps; ++k) {
+                const unsigned char* src = row(y - half + k) + (size_t)v0 * c;
+                const float wk = k1d[k];
+                for (size_t i = 0; i < v_len; ++i) vdst[i] += wk * src[i];
+            }
+        }
+        // Fill the padding beyond the row through the border policy so the horizontal
+        // taps never branch. A mapped column outside this tile gets its own vertical sum.
+        auto pad_column = [&](int x) {
+            const int m = Border::map(x, w);
+            for (int ch = 0; ch < c; ++ch) {
+                float v = 0.0f;
+                if (m >= v0 && m < v1) v = vb[(ptrdiff_t)(m - x0) * c + ch];
+                else if (m >= 0)
+                    for (int k = 0; k < taps; ++k) v += k1d[k] * row(y - half + k)[(size_t)m * c + ch];
+                vb[(ptrdiff_t)(x - x0) * c + ch] = v;
+            }
+        };
+        for (int x = x0 - half; x < v0; ++x) pad_column(x);
+        for (int x = v1; x < x1 + half; ++x) pad_column(x);
+
+        if constexpr (R >= 0) {
+            for (size_t i = 0; i < span; ++i) {
+                float acc = 0.0f;
+                for (int k = 0; k < 2 * R + 1; ++k) acc += k1d[k] * vb[(ptrdiff_t)i + (k - R) * c];
+                hb[i] = acc;
+            }
+        } else {
+            std::fill(hb, hb + span, 0.0f);
+            for (int k = 0; k < taps; ++k) {
+                const float* src = vb + (ptrdiff_t)(k - half) * c;
+                const float wk = k1d[k];
+                for (size_t i = 0; i < span; ++i) hb[i] += wk * src[i];
+            }
+        }
+        unsigned char* dst = out + (size_t)(y - y0) * out_stride;
+        for (size_t i = 0; i < span; ++i) dst[i] = to_uc(hb[i], round_nearest);
+    }
+}
+
+// Full-width rows [y0, y1); out points at row y0.
+template <int R = -1, class Border = BorderClamp, typename RowFn>
+void gaussian_separable_rows(const RowFn& row, unsigned char* out, int w, int c, int y0, int y1,
+                             const float* k1d, int k_size, bool round_nearest,
+                             SeparableScratch& s)
+{
+    gaussian_separable_tile<R, Border>(row, w, c, 0, w, y0, y1, k1d, k_size, round_nearest,
+                                       out, (size_t)w * c, s);
+}
+
+// Columns [x0, x1) of one direct-Gaussian row, all far enough from the row ends
+// that every tap is inside it, so there is no border logic. dst points at column
+// x0. C > 0 fixes the channel count at compile time so the per-channel sums stay
+// in registers; C == 0 uses c.
+template <int C>
+void gaussian_direct_span(const unsigned char* const* src, unsigned char* dst, int x0, int x1, int c,
+                          const float* k2d, int k_size, bool round_nearest)
+{
+    constexpr int MAX_C = C > 0 ? C : 4;
+    const int nc = C > 0 ? C : c;
+    const int half = k_size / 2;
+    for (int x = x0; x < x1; ++x) {
+        float acc[MAX_C] = {};
+        for (int ky = 0; ky < k_size; ++ky) {
+            const unsigned char* p = src[ky] + (size_t)(x - half) * nc;
+            const float* wrow = k2d + ky * k_size;
+            for (int kx = 0; kx < k_size; ++kx) {
+                #pragma GCC unroll 4
+                for (int ch = 0; ch < nc; ++ch) acc[ch] += wrow[kx] * p[kx * nc + ch];
+            }
+        }
+        for (int ch = 0; ch < nc; ++ch) dst[(size_t)(x - x0) * nc + ch] = to_uc(acc[ch], round_nearest);
+    }
+}
+
+// Direct K x K Gaussian for output columns [x0, x1) of rows [y0, y1), with row(y),
+// out and out_stride as in gaussian_separable_tile. Columns in [half, w - half)
+// read their taps straight from the rows; only the strips within `half` of the
+// left and right edge go through Border.
+template <class Border = BorderClamp, typename RowFn>
+void gaussian_direct_tile(const RowFn& row, int w, int c, int x0, int x1, int y0, int y1,
+                          const float* k2d, int k_size, bool round_nearest,
+                          unsigned char* out, size_t out_stride)
+{
+    const int half = k_size / 2;
+    const int a = std::min(std::max(half, x0), x1), b = std::min(std::max(w - half, a), x1);
+    std::vector<const unsigned char*> src(k_size);
+
+    for (int y = y0; y < y1; ++y) {
+        for (int k = 0; k < k_size; ++k) src[k] = row(y - half + k);
+        unsigned char* dst = out + (size_t)(y - y0) * out_stride;
+
+        auto border_pixel = [&](int x) {
+            for (int ch = 0; ch < c; ++ch) {
+                float acc = 0.0f;
+                for (int ky = 0; ky < k_size; ++ky)
+                    for (int kx = 0; kx < k_size; ++kx) {
+                        int nx = Border::map(x - half + kx, w);
+                        if (nx >= 0) acc += k2d[ky * k_size + kx] * src[ky][(size_t)nx * c + ch];
+                    }
+                dst[(size_t)(x - x0) * c + ch] = to_uc(acc, round_nearest);
+            }
+        };
+
+        for (int x = x0; x < a; ++x) border_pixel(x);
+        unsigned char* mid = dst + (size_t)(a - x0) * c;
+        if (c == 3) gaussian_direct_span<3>(src.data(), mid, a, b, 3, k2d, k_size, round_nearest);
+        else if (c == 1) gaussian_direct_span<1>(src.data(), mid, a, b, 1, k2d, k_size, round_nearest);
+        else gaussian_direct_span<0>(src.data(), mid, a, b, c, k2d, k_size, round_nearest);
+        for (int x = b; x < x1; ++x) border_pixel(x);
+    }
+}
+
+// Full-width rows [y0, y1); out points at row y0.
+template <class Border = BorderClamp, typename RowFn>
+void gaussian_direct_rows(const RowFn& row, unsigned char* out, int w, int c, int y0, int y1,
+                          const float* k2d, int k_size, bool round_nearest)
+{
+    gaussian_direct_tile<Border>(row, w, c, 0, w, y0, y1, k2d, k_size, round_nearest, out, (size_t)w * c);
+}
+
+// Young-van Vliet recursion (gaussian.h: iir_coefficients) over n samples spaced
+// `stride` floats apart, for `lanes` interleaved signals at once: sample j of lane l
+// is p[j * stride + l]. Runs the causal pass, then the anti-causal pass in place.
+// Before the first sample (and after the last) the history is the steady state of
+// the edge sample, which for a unit-gain filter is the sample itself.
+inline void iir_forward_backward(float* p, int n, size_t stride, size_t lanes, const IirCoefficients& k) {
+    for (int j = 0; j < n; ++j) {
+        float* x = p + (size_t)j * stride;
+        const float* w1 = p + (size_t)std::max(j - 1, 0) * stride;
+        const float* w2 = p + (size_t)std::max(j - 2, 0) * stride;
+        const float* w3 = p + (size_t)std::max(j - 3, 0) * stride;
+        for (size_t l = 0; l < lanes; ++l) x[l] = k.B * x[l] + k.b1 * w1[l] + k.b2 * w2[l] + k.b3 * w3[l];
+    }
+    for (int j = n - 1; j >= 0; --j) {
+        float* x = p + (size_t)j * stride;
+        const float* w1 = p + (size_t)std::min(j + 1, n - 1) * stride;
+        const float* w2 = p + (size_t)std::min(j + 2, n - 1) * stride;
+        const float* w3 = p + (size_t)std::min(j + 3, n - 1) * stride;
+        for (size_t l = 0; l < lanes; ++l) x[l] = k.B * x[l] + k.b1 * w1[l] + k.b2 * w2[l] + k.b3 * w3[l];
+    }
+}
+
+// Horizontal IIR pass for rows [y0, y1) of an 8-bit image into a float image of the
+// same layout. Each row is extended by `pad` pixels per side through Border first.
+template <class Border>
+void iir_gaussian_rows(const unsigned char* in, float* out, int w, int c, int y0, int y1,
+                       const IirCoefficients& k, int pad, std::vector<float>& line)
+{
+    const size_t row_len = (size_t)w * c;
+    line.resize(row_len + 2 * (size_t)pad * c);
+    for (int y = y0; y < y1; ++y) {
+        const unsigned char* src = in + (size_t)y * row_len;
+        for (int i = -pad; i < w + pad; ++i) {
+            const int m = (i >= 0 && i < w) ? i : Border::map(i, w);
+            float* dst = line.data() + (size_t)(i + pad) * c;
+            for (int ch = 0; ch < c; ++ch) dst[ch] = m < 0 ? 0.0f : src[(size_t)m * c + ch];
+        }
+        iir_forward_backward(line.data(), w + 2 * pad, c, c, k);
+        std::copy(line.data() + (size_t)pad * c, line.data() + (size_t)pad * c + row_len, out + (size_t)y * row_len);
+    }
+}
+
+// Columns per vertical IIR strip: 16 RGB pixels are 48 float lanes, and a strip of
+// a few thousand rows still fits in L2.
+constexpr int IIR_STRIP_WIDTH = 16;
+
+// Vertical IIR pass for columns [x0, x1) of the float image from iir_gaussian_rows,
+// written to the 8-bit output. The column strip, extended by `pad` rows per side
+// through Border, is copied into `strip` so the recursion runs along contiguous rows
+// with every column of the strip as a lane.
+template <class Border>
+void iir_gaussian_columns(const float* in, unsigned char* out, int w, int h, int c, int x0, int x1,
+                          const IirCoefficients& k, int pad, bool round_nearest, std::vector<float>& strip)
+{
+    const size_t row_len = (size_t)w * c, span = (size_t)(x1 - x0) * c;
+    const int n = h + 2 * pad;
+    strip.resize((size_t)n * span);
+    for (int j = 0; j < n; ++j) {
+        const int y = j - pad;
+        const int m = (y >= 0 && y < h) ? y : Border::map(y, h);
+        float* dst = strip.data() + (size_t)j * span;
+        if (m < 0) std::fill(dst, dst + span, 0.0f);
+        else std::copy(in + (size_t)m * row_len + (size_t)x0 * c, in + (size_t)m * row_len + (size_t)x1 * c, dst);
+    }
+    iir_forward_backward(strip.data(), n, span, span, k);
+    for (int y = 0; y < h; ++y) {
+        const float* src = strip.data() + (size_t)(y + pad) * span;
+        unsigned char* dst = out + (size_t)y * row_len + (size_t)x0 * c;
+        for (size_t i = 0; i < span; ++i) dst[i] = to_uc(src[i], round_nearest);
+    }
+}
+
+// Box blur: the mean over a (2r+1) x (2r+1) window, computed with running sums so
+// the cost per pixel does not depend on r. The sums are exact integers, so all
+// engines agree up to the final rounding. (2 * MAX_BOX_RADIUS + 1)^2 * 255 still
+// fits in 32 bits.
+constexpr int MAX_BOX_RADIUS = 2000;
+
+// Horizontal pass for rows [y0, y1): out gets, per channel, the sum over columns
+// [x - r, x + r], with columns outside the row resolved through Border.
+template <class Border>
+void box_sum_rows(const unsigned char* in, uint32_t* out, int w, int c, int y0, int y1, int r,
+                  std::vector<unsigned char>& line)
+{
+    const size_t row_len = (size_t)w * c, pad = (size_t)r * c;
+    line.resize(row_len + 2 * pad);
+    for (int y = y0; y < y1; ++y) {
+        const unsigned char* src = in + (size_t)y * row_len;
+        for (int t = 0; t < r; ++t) {
+            const int ml = Border::map(-1 - t, w), mr = Border::map(w + t, w);
+            for (int ch = 0; ch < c; ++ch) {
+                line[(size_t)(r - 1 - t) * c + ch] = ml < 0 ? 0 : src[(size_t)ml * c + ch];
+                line[(size_t)(r + w + t) * c + ch] = mr < 0 ? 0 : src[(size_t)mr * c + ch];
+            }
+        }
+        std::copy(src, src + row_len, line.data() + pad);
+
+        // The window of pixel x is line[x .. x + 2r]; slide it one pixel at a time.
+        uint32_t* dst = out + (size_t)y * row_len;
+        for (int ch = 0; ch < c; ++ch) {
+            uint32_t sum = 0;
+            for (int k = 0; k <= 2 * r; ++k) sum += line[(size_t)k * c + ch];
+            dst[ch] = sum;
+        }
+        for (size_t i = c; i < row_len; ++i) dst[i] = dst[i - c] + line[i + 2 * pad] - line[i - c];
+    }
+}
+
+// Vertical pass for columns [x0, x1) of h output rows: row(y) returns the
+// horizontal sums of row y for any y in [-r, h + r), with the caller resolving rows
+// beyond the image. Writes the window mean, truncated or rounded to nearest.
+template <typename RowFn>
+void box_mean_columns(const RowFn& row, unsigned char* out, int w, int h, int c, int x0, int x1, int r,
+                      bool round_nearest, std::vector<uint32_t>& acc)
+{
+    const size_t row_len = (size_t)w * c, span = (size_t)(x1 - x0) * c, first = (size_t)x0 * c;
+    acc.assign(span, 0);
+    for (int k = -r; k <= r; ++k) {
+        const uint32_t* src = row(k) + first;
+        for (size_t i = 0; i < span; ++i) acc[i] += src[i];
+    }
+    // The sums stay below 2^32, so in double (v + 0.5) / n is always at least 0.5 / n
+    // away from an integer and truncating it gives exactly floor(v / n).
+    const uint32_t n = (uint32_t)(2 * r + 1) * (uint32_t)(2 * r + 1);
+    const double inv = 1.0 / n, bias = (round_nearest ? n / 2 : 0) + 0.5;
+    for (int y = 0; y < h; ++y) {
+        unsigned char* dst = out + (size_t)y * row_len + first;
+        for (size_t i = 0; i < span; ++i) dst[i] = static_cast<unsigned char>((acc[i] + bias) * inv);
+        if (y + 1 == h) break;
+        const uint32_t* add = row(y + r + 1) + first;
+        const uint32_t* sub = row(y - r) + first;
+        for (size_t i = 0; i < span; ++i) acc[i] += add[i] - sub[i];
+    }
+}
+
+// Copies image pixels [x0 - halo, x1 + halo) x [y0 - halo, y1 + halo) into tile,
+// resolving pixels outside the image with Border. The tile is then a small
+// self-contained image whose interior can be filtered without any border logic.
+template <class Border>
+void load_haloed_tile(const unsigned char* in, int w, int h, int c, int x0, int x1, int y0, int y1,
+                      int halo, std::vector<unsigned char>& tile)
+{
+    const int tw = x1 - x0 + 2 * halo, th = y1 - y0 + 2 * halo;
+    const size_t tile_row = (size_t)tw * c;
+    tile.resize(tile_row * th);
+    // Columns [a, b) are inside the image and copied as one run per row.
+    const int a = std::max(x0 - halo, 0), b = std::min(x1 + halo, w);
+    for (int j = 0; j < th; ++j) {
+        const int y = y0 - halo + j;
+        const int m = (y >= 0 && y < h) ? y : Border::map(y, h);
+        unsigned char* dst = tile.data() + (size_t)j * tile_row;
+        if (m < 0) { std::fill(dst, dst + tile_row, 0); continue; }
+        const unsigned char* src = in + (size_t)m * w * c;
+        std::copy(src + (size_t)a * c, src + (size_t)b * c, dst + (size_t)(a - (x0 - halo)) * c);
+        auto edge_pixel = [&](int x) {
+            const int mx = Border::map(x, w);
+            unsigned char* p = dst + (size_t)(x - (x0 - halo)) * c;
+            for (int ch = 0; ch < c; ++ch) p[ch] = mx < 0 ? 0 : src[(size_t)mx * c + ch];
+        };
+        for (int x = x0 - halo; x < a; ++x) edge_pixel(x);
+        for (int x = b; x < x1 + halo; ++x) edge_pixel(x);
+    }
+}
+
+#endif
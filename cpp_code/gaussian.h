@@ -0,0 +1,158 @@
+#ifndef GAUSSIAN_H
+#define GAUSSIAN_H
+
+#include <algorithm>
+#include <array>
+#include <vector>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+#include "options.h"
+
+// Gaussian weights generated from (radius, sigma) instead of pasted tables.
+// Everything below is constexpr so fixed radii can be baked in at compile time,
+// and the same code builds the kernel at runtime from --radius / --sigma.
+
+// The tables the engines used to hard-code were radius 4 with sigma 13.
+constexpr float DEFAULT_GAUSSIAN_SIGMA = 13.0f;
+constexpr int MAX_GAUSSIAN_RADIUS = 64;
+
+namespace gaussian_detail {
+// std::exp is not constexpr before C++26: halve x until the Taylor series
+// converges quickly, then square the result back up.
+constexpr double cexp(double x) {
+    int halvings = 0;
+    while (x > 0.5 || x < -0.5) { x *= 0.5; ++halvings; }
+    double term = 1.0, sum = 1.0;
+    for (int k = 1; k < 20; ++k) { term *= x / k; sum += term; }
+    while (halvings-- > 0) sum *= sum;
+    return sum;
+}
+}
+
+// Normalized 1D weights for taps -radius..radius, written to out[0 .. 2*radius].
+constexpr void fill_gaussian_1d(float* out, int radius, double sigma) {
+    double sum = 0.0;
+    for (int i = -radius; i <= radius; ++i) sum += gaussian_detail::cexp(-(i * i) / (2.0 * sigma * sigma));
+    for (int i = -radius; i <= radius; ++i)
+        out[i + radius] = static_cast<float>(gaussian_detail::cexp(-(i * i) / (2.0 * sigma * sigma)) / sum);
+}
+
+// Row-major (2R+1) x (2R+1) weights as the outer product of the 1D weights.
+constexpr void fill_gaussian_2d(float* out, int radius, double sigma) {
+    const int k = 2 * radius + 1;
+    double sum = 0.0;
+    for (int i = -radius; i <= radius; ++i) sum += gaussian_detail::cexp(-(i * i) / (2.0 * sigma * sigma));
+    for (int y = -radius; y <= radius; ++y)
+        for (int x = -radius; x <= radius; ++x)
+            out[(y + radius) * k + (x + radius)] = static_cast<float>(
+                gaussian_detail::cexp(-(y * y) / (2.0 * sigma * sigma)) *
+                gaussian_detail::cexp(-(x * x) / (2.0 * sigma * sigma)) / (sum * sum));
+}
+
+template <int R>
+constexpr std::array<float, 2 * R + 1> gaussian_1d(double sigma) {
+    std::array<float, 2 * R + 1> w{};
+    fill_gaussian_1d(w.data(), R, sigma);
+    return w;
+}
+
+template <int R>
+constexpr std::array<float, (2 * R + 1) * (2 * R + 1)> gaussian_2d(double sigma) {
+    std::array<float, (2 * R + 1) * (2 * R + 1)> w{};
+    fill_gaussian_2d(w.data(), R, sigma);
+    return w;
+}
+
+// The generator reproduces the old hard-coded 9x9 table (centre 1.28385867e-02).
+static_assert(gaussian_2d<4>(DEFAULT_GAUSSIAN_SIGMA)[40] > 1.28385e-02f &&
+              gaussian_2d<4>(DEFAULT_GAUSSIAN_SIGMA)[40] < 1.28387e-02f);
+
+struct GaussianKernel {
+    int radius;
+    float sigma;
+    std::vector<float> w1d;  // 2R+1 taps
+    std::vector<float> w2d;  // (2R+1)^2 taps, row-major
+
+    int size() const { return 2 * radius + 1; }
+};
+
+inline GaussianKernel make_gaussian_kernel(int radius, float sigma) {
+    GaussianKernel k{radius, sigma, std::vector<float>(2 * radius + 1),
+                     std::vector<float>((2 * radius + 1) * (2 * radius + 1))};
+    fill_gaussian_1d(k.w1d.data(), radius, sigma);
+    fill_gaussian_2d(k.w2d.data(), radius, sigma);
+    return k;
+}
+
+inline float gaussian_sigma_from_options(const Options& opts) {
+    float sigma = opts.get_float("sigma", DEFAULT_GAUSSIAN_SIGMA);
+    if (!(sigma > 0.0f)) throw std::invalid_argument("--sigma must be positive");
+    return sigma;
+}
+
+// Reads --radius / --sigma. Without either flag, or with --sigma at its default,
+// the engine's historical kernel is used. A different --sigma alone, or
+// --radius=auto, picks radius ceil(3 * sigma).
+inline GaussianKernel gaussian_kernel_from_options(const Options& opts, int default_radius,
+                                                   int max_radius = MAX_GAUSSIAN_RADIUS) {
+    float sigma = gaussian_sigma_from_options(opts);
+    const bool derived = opts.get("radius", "") == "auto" || (!opts.has("radius") && sigma != DEFAULT_GAUSSIAN_SIGMA);
+    int radius = default_radius;
+    if (derived) radius = static_cast<int>(std::min(std::ceil(3.0 * sigma), 1e9));
+    else if (opts.has("radius")) radius = opts.get_int("radius", default_radius);
+    if (radius < 0 || radius > max_radius) {
+        if (derived)
+            throw std::invalid_argument("Gaussian radius ceil(3*sigma) = " + std::to_string(radius) +
+                                        " must be between 0 and " + std::to_string(max_radius) +
+                                        "; pass a smaller --sigma or an explicit --radius");
+        throw std::invalid_argument("--radius must be between 0 and " + std::to_string(max_radius));
+    }
+    return make_gaussian_kernel(radius, sigma);
+}
+
+// Recursive Gaussian (Young & van Vliet, "Recursive implementation of the Gaussian
+// filter", 1995): a causal and an anti-causal three-pole filter whose cost per pixel
+// does not depend on sigma. b1..b3 are already divided by b0, and B + b1 + b2 + b3 == 1.
+struct IirCoefficients {
+    float B, b1, b2, b3;
+};
+
+inline IirCoefficients iir_coefficients(float sigma) {
+    if (sigma < 0.5f) throw std::invalid_argument("--gaussian-impl=iir needs --sigma of at least 0.5");
+    const double q = sigma >= 2.5 ? 0.98711 * sigma - 0.96330
+                                  : 3.97156 - 4.14554 * std::sqrt(1.0 - 0.26891 * sigma);
+    const double q2 = q * q, q3 = q2 * q;
+    const double b0 = 1.57825 + 2.44413 * q + 1.4281 * q2 + 0.422205 * q3;
+    const double b1 = (2.44413 * q + 2.85619 * q2 + 1.26661 * q3) / b0;
+    const double b2 = -(1.4281 * q2 + 1.26661 * q3) / b0;
+    const double b3 = 0.422205 * q3 / b0;
+    return {static_cast<float>(1.0 - (b1 + b2 + b3)), static_cast<float>(b1),
+            static_cast<float>(b2), static_cast<float>(b3)};
+}
+
+// Samples the recursive filter reads beyond each image edge; past 4 sigma the
+// response is negligible.
+inline int iir_padding(float sigma) { return static_cast<int>(std::ceil(4.0f * sigma)); }
+
+// Calls f(std::integral_constant<int, R>{}) for the radii that get a fully unrolled
+// specialization, and f(std::integral_constant<int, -1>{}) for every other radius.
+template <typename F>
+void dispatch_radius(int radius, F&& f) {
+    switch (radius) {
+        case 1: f(std::integral_constant<int, 1>{}); break;
+        case 2: f(std::integral_constant<int, 2>{}); break;
+        case 3: f(std::integral_constant<int, 3>{}); break;
+        case 4: f(std::integral_constant<int, 4>{}); break;
+        case 5: f(std::integral_constant<int, 5>{}); break;
+        case 6: f(std::integral_constant<int, 6>{}); break;
+        case 7: f(std::integral_constant<int, 7>{}); break;
+        case 8: f(std::integral_constant<int, 8>{}); break;
+        case 13: f(std::integral_constant<int, 13>{}); break;
+        default: f(std::integral_constant<int, -1>{}); break;
+    }
+}
+
+#endif
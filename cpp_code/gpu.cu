@@ -1,6 +1,7 @@
 #include <iostream>
 #include <filesystem>
 #include <vector>
+#include <algorithm>
 #include <thread>
 #include <string>
 #include <numeric>
@@ -17,15 +18,18 @@
 #include "stb_image_write.h"
 
 #include "filters.cuh"
+#include "options.h"
+#include "gaussian.h"
+#include "pipeline.h"
 
 namespace fs = std::filesystem;
 
 struct Image {
-    std::string name, ext;
-    int width, height, channels_in;
-    int channels_out;
-    unsigned char* input_host;
-    unsigned char* output_host;
+    std::string path, name, ext;
+    int width = 0, height = 0, channels_in = 0;
+    int channels_out = 0;
+    unsigned char* input_host = nullptr;
+    unsigned char* output_host = nullptr;
 
     float time_load_ms = 0.0f;
     float time_gpu_ms = 0.0f;
@@ -49,18 +53,6 @@ struct Image {
 };
 
 
-const float GAUSSIAN_9x9[81] = {
-    1.16788635e-02f, 1.19232554e-02f, 1.21009460e-02f, 1.22088289e-02f, 1.22450031e-02f, 1.22088289e-02f, 1.21009460e-02f, 1.19232554e-02f, 1.16788635e-02f,
-    1.19232554e-02f, 1.21727614e-02f, 1.23541704e-02f, 1.24643108e-02f, 1.25012421e-02f, 1.24643108e-02f, 1.23541704e-02f, 1.21727614e-02f, 1.19232554e-02f,
-    1.21009460e-02f, 1.23541704e-02f, 1.25382828e-02f, 1.26500647e-02f, 1.26875463e-02f, 1.26500647e-02f, 1.25382828e-02f, 1.23541704e-02f, 1.21009460e-02f,
-    1.22088289e-02f, 1.24643108e-02f, 1.26500647e-02f, 1.27628431e-02f, 1.28006589e-02f, 1.27628431e-02f, 1.26500647e-02f, 1.24643108e-02f, 1.22088289e-02f,
-    1.22450031e-02f, 1.25012421e-02f, 1.26875463e-02f, 1.28006589e-02f, 1.28385867e-02f, 1.28006589e-02f, 1.26875463e-02f, 1.25012421e-02f, 1.22450031e-02f,
-    1.22088289e-02f, 1.24643108e-02f, 1.26500647e-02f, 1.27628431e-02f, 1.28006589e-02f, 1.27628431e-02f, 1.26500647e-02f, 1.24643108e-02f, 1.22088289e-02f,
-    1.21009460e-02f, 1.23541704e-02f, 1.25382828e-02f, 1.26500647e-02f, 1.26875463e-02f, 1.26500647e-02f, 1.25382828e-02f, 1.23541704e-02f, 1.21009460e-02f,
-    1.19232554e-02f, 1.21727614e-02f, 1.23541704e-02f, 1.24643108e-02f, 1.25012421e-02f, 1.24643108e-02f, 1.23541704e-02f, 1.21727614e-02f, 1.19232554e-02f,
-    1.16788635e-02f, 1.19232554e-02f, 1.21009460e-02f, 1.22088289e-02f, 1.22450031e-02f, 1.22088289e-02f, 1.21009460e-02f, 1.19232554e-02f, 1.16788635e-02f
-};
-
 const float sobel_x[9] = {-1, 0, 1, -2, 0, 2, -1, 0, 1};
 const float sobel_y[9] = {-1, -2, -1, 0, 0, 0, 1, 2, 1};
 
@@ -70,8 +62,9 @@ int main(int argc, char** argv)
 {
 
     if (argc < 4) {
-        std::cerr << "Usage: ./ProjectCode <input_folder> <output_folder> <operation>\n";
+        std::cerr << "Usage: ./ProjectCode <input_folder> <output_folder> <operation> [options]\n";
         std::cerr << "Operations: grayscale | gaussian | sobel\n";
+        std::cerr << "Options: --radius=<px> --sigma=<px> --max-inflight=<n> --max-memory=<MB> --io-threads=<n>\n";
         return 1;
     }
 
@@ -79,7 +72,16 @@ int main(int argc, char** argv)
     std::string output_folder = argv[2];
     std::string op = argv[3];
 
-    const int KERNEL_SIZE_GAUSSIAN = 9;
+    GaussianKernel gaussian;
+    PipelineLimits limits;
+    try {
+        Options opts = parse_options(argc, argv, 4);
+        if (op == "gaussian") gaussian = gaussian_kernel_from_options(opts, 4, GAUSSIAN_MAX_RADIUS);
+        limits = pipeline_limits_from_options(opts, (int)std::max(1u, std::thread::hardware_concurrency()));
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
 
     int output_channels;
     if (op == "grayscale" || op == "sobel") {
@@ -93,63 +95,89 @@ int main(int argc, char** argv)
 
     fs::create_directories(output_folder);
 
+    // Only names are listed up front; pixels are decoded as the pipeline admits them.
     std::vector<Image> images;
-    size_t max_input_bytes = 0;
-    size_t max_output_bytes = 0;
-
     for (const auto& entry : fs::directory_iterator(folder)) {
         if (!entry.is_regular_file()) continue;
         Image img;
+        img.path = entry.path().string();
         img.name = entry.path().stem().string();
         img.ext = entry.path().extension().string();
+        images.push_back(img);
+    }
+    if (images.empty()) {
+        std::cerr << "No images found in " << folder << "\n";
+        return 1;
+    }
+
+    // Sized from the file header so the image can wait for budget before it is decoded.
+    auto image_bytes = [&](size_t i) -> size_t {
+        int w = 0, h = 0, c = 0;
+        if (!stbi_info(images[i].path.c_str(), &w, &h, &c)) return 0;
+        return (size_t)w * h * (3 + output_channels);
+    };
+
+    auto load = [&](size_t i) {
+        Image& img = images[i];
         auto host_start = std::chrono::high_resolution_clock::now();
         int w, h, c;
-        img.input_host = stbi_load(entry.path().c_str(), &w, &h, &c, 3);
+        img.input_host = stbi_load(img.path.c_str(), &w, &h, &c, 3);
         auto host_stop = std::chrono::high_resolution_clock::now();
         img.time_load_ms = std::chrono::duration<float, std::milli>(host_stop - host_start).count();
         if (!img.input_host) {
-            std::cerr << "Failed to load " << entry.path() << "\n";
-            continue;
+            std::cerr << "Failed to load " << img.path << "\n";
+            return false;
         }
         img.width = w; img.height = h; img.channels_in = 3;
         img.channels_out = output_channels;
         size_t output_size = (size_t)w * h * img.channels_out;
         img.output_host = new unsigned char[output_size];
-        images.push_back(img);
-        max_input_bytes = std::max(max_input_bytes, (size_t)w * h * img.channels_in);
-        max_output_bytes = std::max(max_output_bytes, output_size);
-    }
-    if (images.empty()) {
-        std::cerr << "No images found in " << folder << "\n";
-        return 1;
-    }
+        return true;
+    };
 
     if (op == "gaussian") {
-        cudaMemcpyToSymbol(GAUSSIAN_KERNEL, GAUSSIAN_9x9, sizeof(GAUSSIAN_9x9));
+        cudaMemcpyToSymbol(GAUSSIAN_KERNEL, gaussian.w2d.data(), gaussian.w2d.size() * sizeof(float));
     }
     if (op == "sobel") {
         cudaMemcpyToSymbol(SOBEL_X, sobel_x, sizeof(sobel_x));
         cudaMemcpyToSymbol(SOBEL_Y, sobel_y, sizeof(sobel_y));
     }
 
-    unsigned char *d_input, *d_output;
-    cudaMalloc(&d_input, max_input_bytes);
-    cudaMalloc(&d_output, max_output_bytes);
+    // Image sizes are only known as they stream in, so the device buffers grow to
+    // the largest image seen so far.
+    unsigned char *d_input = nullptr, *d_output = nullptr;
+    size_t d_input_bytes = 0, d_output_bytes = 0;
     dim3 block(16, 16);
     cudaEvent_t start, stop;
     cudaEventCreate(&start);
     cudaEventCreate(&stop);
 
-    for (auto& img : images) {
+    auto process = [&](size_t i) {
+        Image& img = images[i];
         size_t inSize = (size_t)img.width * img.height * img.channels_in;
         size_t outSize = (size_t)img.width * img.height * img.channels_out;
+        if (inSize > d_input_bytes) {
+            cudaFree(d_input);
+            cudaMalloc(&d_input, inSize);
+            d_input_bytes = inSize;
+        }
+        if (outSize > d_output_bytes) {
+            cudaFree(d_output);
+            cudaMalloc(&d_output, outSize);
+            d_output_bytes = outSize;
+        }
         cudaEventRecord(start);
         cudaMemcpy(d_input, img.input_host, inSize, cudaMemcpyHostToDevice);
         dim3 grid((img.width + block.x - 1) / block.x, (img.height + block.y - 1) / block.y);
         if (op == "grayscale") {
             grayscale_kernel<<<grid, block>>>(d_input, d_output, img.width, img.height, img.channels_in);
         } else if (op == "gaussian") {
-            gaussian_blur_kernel_color<<<grid, block>>>(d_input, d_output, img.width, img.height, img.channels_in, KERNEL_SIZE_GAUSSIAN);
+            dispatch_radius(gaussian.radius, [&](auto radius) {
+                if constexpr (radius.value >= 0 && radius.value <= GAUSSIAN_MAX_RADIUS)
+                    gaussian_blur_kernel_color_r<radius.value><<<grid, block>>>(d_input, d_output, img.width, img.height, img.channels_in);
+                else
+                    gaussian_blur_kernel_color<<<grid, block>>>(d_input, d_output, img.width, img.height, img.channels_in, gaussian.size());
+            });
         } else if (op == "sobel") {
             sobel_filter_kernel<<<grid, block>>>(d_input, d_output, img.width, img.height, img.channels_in);
         }
@@ -157,25 +185,29 @@ int main(int argc, char** argv)
         cudaEventRecord(stop);
         cudaEventSynchronize(stop);
         cudaEventElapsedTime(&img.time_gpu_ms, start, stop);
-    }
+    };
 
-    std::vector<std::thread> save_threads;
-    for (auto& img : images) {
-        save_threads.emplace_back([&img, output_folder, op]() {
-            std::string outPath = (fs::path(output_folder) / (img.name + "_" + op + ".png")).string();
-            int stride = img.width * img.channels_out;
-            auto host_start = std::chrono::high_resolution_clock::now();
-            stbi_write_png(outPath.c_str(), img.width, img.height,
-                           img.channels_out, img.output_host, stride);
-            auto host_stop = std::chrono::high_resolution_clock::now();
-            img.time_save_ms = std::chrono::duration<float, std::milli>(host_stop - host_start).count();
-            stbi_image_free(img.input_host);
-            delete[] img.output_host;
-            img.input_host = nullptr;
-            img.output_host = nullptr;
-        });
-    }
-    for (auto& t : save_threads) { t.join(); }
+    auto save = [&](size_t i) {
+        Image& img = images[i];
+        std::string outPath = (fs::path(output_folder) / (img.name + "_" + op + ".png")).string();
+        int stride = img.width * img.channels_out;
+        auto host_start = std::chrono::high_resolution_clock::now();
+        stbi_write_png(outPath.c_str(), img.width, img.height,
+                       img.channels_out, img.output_host, stride);
+        auto host_stop = std::chrono::high_resolution_clock::now();
+        img.time_save_ms = std::chrono::duration<float, std::milli>(host_stop - host_start).count();
+        stbi_image_free(img.input_host);
+        delete[] img.output_host;
+        img.input_host = nullptr;
+        img.output_host = nullptr;
+    };
+
+    // CUDA calls stay on this thread; decoding and PNG encoding overlap with them.
+    PipelineStats stats = run_pipeline(images.size(), limits, image_bytes, load, process, save);
+
+    // Files that failed to decode are left out of the report.
+    images.erase(std::remove_if(images.begin(), images.end(), [](const Image& img) { return img.width == 0; }),
+                 images.end());
 
     float total_load_ms = 0.0f;
     float total_process_ms = 0.0f;
@@ -193,6 +225,7 @@ int main(int argc, char** argv)
     std::cout << "  \"total_loading_time\": " << total_load_ms << ",\n";
     std::cout << "  \"total_processing_time\": " << total_process_ms << ",\n";
     std::cout << "  \"total_exporting_time\": " << total_export_ms << ",\n";
+    std::cout << "  \"total_exporting_wall_time\": " << stats.export_wall_ms << ",\n";
     std::cout << "  \"individual_image_times\": [\n";
 
     for (size_t i = 0; i < images.size(); ++i) {
@@ -215,6 +248,7 @@ int main(int argc, char** argv)
     json_file << "  \"total_loading_time\": " << total_load_ms << ",\n";
     json_file << "  \"total_processing_time\": " << total_process_ms << ",\n";
     json_file << "  \"total_exporting_time\": " << total_export_ms << ",\n";
+    json_file << "  \"total_exporting_wall_time\": " << stats.export_wall_ms << ",\n";
     json_file << "  \"individual_image_times\": [\n";
 
     for (size_t i = 0; i < images.size(); ++i) {
@@ -8,12 +8,31 @@
 #include <cmath>
 #include <filesystem>
 #include <algorithm>
+#include <numeric>
+#include <cstdlib>
+#include <thread>
+#include <deque>
+#include <utility>
+#include <iterator>
+#include <cstdint>
+#include <cstring>
+#include <climits>
+#include <map>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #define STB_IMAGE_IMPLEMENTATION
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image.h"
 #include "stb_image_write.h"
 
+#include "options.h"
+#include "filters.h"
+#include "gaussian.h"
+#include "simd.h"
+#include "pipeline.h"
+
 namespace fs = std::filesystem;
 
 struct ImageTiming {
@@ -23,371 +42,1135 @@ struct ImageTiming {
     double export_ms;
 };
 
+// Each rank's share of the work is split across its OpenMP threads (one rank per
+// NUMA domain, threads for its cores). Only the main thread calls MPI
+// (MPI_THREAD_FUNNELED): every MPI call sits outside the parallel regions.
 
-const int KERNEL_SIZE_SOBEL = 3;
-const float sobel_x[9] = {-1, 0, 1, -2, 0, 2, -1, 0, 1};
-const float sobel_y[9] = {-1, -2, -1, 0, 0, 0, 1, 2, 1};
-
-const int KERNEL_SIZE_GAUSSIAN = 9;
-const int GAUSSIAN_RADIUS = 4; // (9 / 2)
-const float GAUSSIAN_9x9[81] = {
-    1.16788635e-02f, 1.19232554e-02f, 1.21009460e-02f, 1.22088289e-02f, 1.22450031e-02f, 1.22088289e-02f, 1.21009460e-02f, 1.19232554e-02f, 1.16788635e-02f,
-    1.19232554e-02f, 1.21727614e-02f, 1.23541704e-02f, 1.24643108e-02f, 1.25012421e-02f, 1.24643108e-02f, 1.23541704e-02f, 1.21727614e-02f, 1.19232554e-02f,
-    1.21009460e-02f, 1.23541704e-02f, 1.25382828e-02f, 1.26500647e-02f, 1.26875463e-02f, 1.26500647e-02f, 1.25382828e-02f, 1.23541704e-02f, 1.21009460e-02f,
-    1.22088289e-02f, 1.24643108e-02f, 1.26500647e-02f, 1.27628431e-02f, 1.28006589e-02f, 1.27628431e-02f, 1.26500647e-02f, 1.24643108e-02f, 1.22088289e-02f,
-    1.22450031e-02f, 1.25012421e-02f, 1.26875463e-02f, 1.28006589e-02f, 1.28385867e-02f, 1.28006589e-02f, 1.26875463e-02f, 1.25012421e-02f, 1.22450031e-02f,
-    1.22088289e-02f, 1.24643108e-02f, 1.26500647e-02f, 1.27628431e-02f, 1.28006589e-02f, 1.27628431e-02f, 1.26500647e-02f, 1.24643108e-02f, 1.22088289e-02f,
-    1.21009460e-02f, 1.23541704e-02f, 1.25382828e-02f, 1.26500647e-02f, 1.26875463e-02f, 1.26500647e-02f, 1.25382828e-02f, 1.23541704e-02f, 1.21009460e-02f,
-    1.19232554e-02f, 1.21727614e-02f, 1.23541704e-02f, 1.24643108e-02f, 1.25012421e-02f, 1.24643108e-02f, 1.23541704e-02f, 1.21727614e-02f, 1.19232554e-02f,
-    1.16788635e-02f, 1.19232554e-02f, 1.21009460e-02f, 1.22088289e-02f, 1.22450031e-02f, 1.22088289e-02f, 1.21009460e-02f, 1.19232554e-02f, 1.16788635e-02f
-};
+// rgb_to_gray_row over n pixels in fixed-size chunks, so narrow strips still give
+// every thread full vectors.
+void rgb_to_gray_parallel(const unsigned char* in, unsigned char* out, size_t n)
+{
+    const size_t chunk = 1 << 16;
+    const long long chunks = (long long)((n + chunk - 1) / chunk);
+    #pragma omp parallel for schedule(static)
+    for(long long i=0;i<chunks;i++){
+        size_t first = (size_t)i*chunk;
+        rgb_to_gray_row(in + first*3, out + first, std::min(chunk, n-first));
+    }
+}
 
 
 
-inline unsigned char to_gray_uc(unsigned char r, unsigned char g, unsigned char b) {
-    float gray = 0.299f * r + 0.587f * g + 0.114f * b;
-    int gi = static_cast<int>(gray + 0.5f);
-    if (gi < 0) gi = 0; if (gi > 255) gi = 255;
-    return static_cast<unsigned char>(gi);
+// Splits n rows (or columns) into `parts` runs as evenly as possible; run i is
+// [first, last).
+void split_range(int n, int parts, int i, int& first, int& last)
+{
+    const int base=n/parts, rem=n%parts;
+    first = i*base + std::min(i, rem);
+    last = first + base + (i<rem?1:0);
 }
 
-inline unsigned char clamp_uc(float v) {
-    int iv = static_cast<int>(v + 0.5f);
-    if (iv < 0) iv = 0;
-    if (iv > 255) iv = 255;
-    return static_cast<unsigned char>(iv);
+// Splits n into `parts` runs as long as their weights, each at least `need` long;
+// run i is [edges[i], edges[i+1]). Without weights, or when a run would come out
+// too short, the split is split_range's even one.
+void split_weighted(int n, int parts, const double* weight, int need, std::vector<int>& edges)
+{
+    edges.assign(parts+1, 0);
+    double total = 0, acc = 0;
+    if(weight) for(int i=0;i<parts;i++) total += weight[i];
+    bool ok = total > 0;
+    for(int i=1;i<=parts && ok;i++){
+        acc += weight[i-1];
+        edges[i] = i==parts ? n : (int)std::lround(n*acc/total);
+        ok = edges[i]-edges[i-1] >= need;
+    }
+    if(!ok) for(int i=1;i<=parts;i++) split_range(n, parts, i-1, edges[i-1], edges[i]);
 }
 
+// Blocks down x blocks across for an image over up to `ranks` ranks. Uses as many
+// ranks as can each get a block at least `halo` pixels deep along every split
+// axis, so every halo comes from the adjacent blocks; among those grids, the one
+// with the least halo per block. A short, wide image gets column blocks, and with
+// no halo the blocks are row strips, which scatter as contiguous runs.
+void choose_grid(int width, int height, int ranks, int halo, int dims[2])
+{
+    const int need = std::max(halo, 1);
+    for(int n=ranks;n>1;n--){
+        long best=-1;
+        for(int down=n;down>=1;down--){
+            if(n%down) continue;
+            const int across=n/down;
+            if((down>1 && height/down<need) || (across>1 && width/across<need)) continue;
+            // Halo of a middle block: two rows of its width and two columns of its height.
+            const long bw=(width+across-1)/across, bh=(height+down-1)/down;
+            const long cost=(long)halo*((down>1?2*bw:0) + (across>1?2*bh:0));
+            if(best<0 || cost<best){ best=cost; dims[0]=down; dims[1]=across; }
+        }
+        if(best>=0) return;
+    }
+    dims[0]=dims[1]=1;
+}
 
+// Block edges down (rows) and across (cols) for a choose_grid grid. With --balance=
+// speed, `speed` has one entry per rank of the grid's communicator, and each block
+// row is as tall, and each block column as wide, as the summed speed of its ranks:
+// a block's area then follows its rank's speed as closely as a grid of whole rows
+// and columns allows. Empty speed splits evenly.
+void grid_edges(int width, int height, const int dims[2], int halo, const std::vector<double>& speed,
+                std::vector<int>& rows, std::vector<int>& cols)
+{
+    std::vector<double> down, across;
+    if(!speed.empty()){
+        down.assign(dims[0], 0.0);
+        across.assign(dims[1], 0.0);
+        // make_grid does not reorder ranks, so grid rank q sits at row-major coordinates.
+        for(int q=0;q<dims[0]*dims[1];q++){
+            down[q/dims[1]] += speed[q];
+            across[q%dims[1]] += speed[q];
+        }
+    }
+    const int need = std::max(halo, 1);
+    split_weighted(height, dims[0], down.empty() ? nullptr : down.data(), need, rows);
+    split_weighted(width, dims[1], across.empty() ? nullptr : across.data(), need, cols);
+}
 
+// One image split into blocks over a 2D Cartesian grid of ranks. A rank works on
+// its block inside a tile with a halo as deep as the filter radius on every side,
+// holding its neighbours' edge pixels or pixels beyond the image resolved through
+// the border policy, so the kernels run on the tile without any border logic.
+struct BlockGrid {
+    MPI_Comm cart = MPI_COMM_NULL;       // MPI_COMM_NULL on ranks the grid leaves out
+    int dims[2] = {1, 1};                // blocks down, blocks across
+    int coords[2] = {0, 0};              // this rank's block row and column
+    int rank = 0;                        // rank in cart; rank 0 holds the image
+    int width = 0, height = 0;
+    int x0 = 0, x1 = 0, y0 = 0, y1 = 0;  // this rank's block
+    std::vector<int> rows, cols;         // block edges down and across, from grid_edges
+    std::vector<int> strips;             // edges of the row strips each rank encodes with Codec::Ranks
+    // Rank of the block in direction (dy, dx) at (dy + 1) * 3 + dx + 1, or
+    // MPI_PROC_NULL where that side of the halo is filled locally.
+    int neighbours[9];
+
+    int block_w() const { return x1-x0; }
+    int block_h() const { return y1-y0; }
+};
 
-void mpi_grayscale(const std::string &input_path, const std::string &output_path,
-                   int rank, int size,
-                   ImageTiming& timing) 
+void block_of(const BlockGrid& g, int q, int& x0, int& x1, int& y0, int& y1)
 {
-    int width=0, height=0, channels=3;
-    unsigned char *full_img=nullptr;
-    double t0, t1, t2, t3, t4;
+    int c[2];
+    MPI_Cart_coords(g.cart, q, 2, c);
+    y0 = g.rows[c[0]]; y1 = g.rows[c[0]+1];
+    x0 = g.cols[c[1]]; x1 = g.cols[c[1]+1];
+}
 
-    t0 = MPI_Wtime();
-    if(rank==0){
-        full_img = stbi_load(input_path.c_str(), &width, &height, &channels, 3);
-        if(!full_img){
-            std::cerr<<"Failed to load "<<input_path<<"\n";
-            MPI_Abort(MPI_COMM_WORLD,1);
+// Collective over comm; speed as for grid_edges. With wrap the grid is a torus, so the edge blocks exchange
+// halos with the opposite edge; an axis with a single block resolves its halo
+// locally instead.
+BlockGrid make_grid(MPI_Comm comm, int size, int width, int height, int halo, BorderMode border,
+                    const std::vector<double>& speed)
+{
+    BlockGrid g;
+    g.width=width; g.height=height;
+    choose_grid(width, height, size, halo, g.dims);
+    const bool wrap = border==BorderMode::Wrap;
+    const int periods[2] = {wrap && g.dims[0]>1, wrap && g.dims[1]>1};
+    // No reordering, so rank 0 of comm, which loaded the image, is rank 0 of the grid.
+    MPI_Cart_create(comm, 2, g.dims, periods, 0, &g.cart);
+    if(g.cart==MPI_COMM_NULL) return g;
+    MPI_Comm_rank(g.cart, &g.rank);
+    MPI_Cart_coords(g.cart, g.rank, 2, g.coords);
+    grid_edges(width, height, g.dims, halo, speed, g.rows, g.cols);
+    split_weighted(height, g.dims[0]*g.dims[1], speed.empty() ? nullptr : speed.data(), 1, g.strips);
+    block_of(g, g.rank, g.x0, g.x1, g.y0, g.y1);
+
+    for(int dy=-1;dy<=1;dy++)
+        for(int dx=-1;dx<=1;dx++){
+            const int d[2] = {dy, dx};
+            int c[2] = {g.coords[0]+dy, g.coords[1]+dx};
+            bool exists = dy!=0 || dx!=0;
+            for(int a=0;a<2;a++){
+                if(d[a]==0) continue;
+                if(g.dims[a]==1 || ((c[a]<0 || c[a]>=g.dims[a]) && !periods[a])) exists = false;
+                else c[a] = (c[a]+g.dims[a])%g.dims[a];
+            }
+            int& nb = g.neighbours[(dy+1)*3+dx+1];
+            nb = MPI_PROC_NULL;
+            if(exists) MPI_Cart_rank(g.cart, c, &nb);
         }
-        channels = 3;
-    }
-    t1 = MPI_Wtime(); 
-    timing.load_ms = (t1-t0) * 1000.0;
+    return g;
+}
 
- 
-    double t_proc_start = MPI_Wtime();
+void free_grid(BlockGrid& g)
+{
+    if(g.cart!=MPI_COMM_NULL) MPI_Comm_free(&g.cart);
+}
 
-    MPI_Bcast(&width,1,MPI_INT,0,MPI_COMM_WORLD);
-    MPI_Bcast(&height,1,MPI_INT,0,MPI_COMM_WORLD);
-    MPI_Bcast(&channels,1,MPI_INT,0,MPI_COMM_WORLD);
+// The rows x cols region at (y, x) of a height x width image with c channels.
+// Pending operations keep the type alive, so callers free it right after posting.
+MPI_Datatype region_type(int height, int width, int c, int y, int x, int rows, int cols)
+{
+    int sizes[3]={height,width,c}, sub[3]={rows,cols,c}, start[3]={y,x,0};
+    MPI_Datatype t;
+    MPI_Type_create_subarray(3,sizes,sub,start,MPI_ORDER_C,MPI_UNSIGNED_CHAR,&t);
+    MPI_Type_commit(&t);
+    return t;
+}
 
-    int base=height/size, rem=height%size;
-    int myrows = base + (rank<rem?1:0);
+// The block inside a tile with `halo` pixels on every side.
+MPI_Datatype tile_block_type(const BlockGrid& g, int c, int halo)
+{
+    return region_type(g.block_h()+2*halo, g.block_w()+2*halo, c, halo, halo, g.block_h(), g.block_w());
+}
 
-    std::vector<int> sendcounts(size), displs(size);
-    if(rank==0){
-        int off=0;
-        for(int r=0;r<size;r++){
-            int rows = base + (r<rem?1:0);
-            sendcounts[r]=rows*width*channels;
-            displs[r]=off;
-            off+=sendcounts[r];
+// Sends every rank of the grid its block of full (read on rank 0) into its tile.
+void scatter_blocks(const unsigned char* full, int c, unsigned char* tile, int halo, const BlockGrid& g)
+{
+    std::vector<MPI_Request> requests;
+    MPI_Request req;
+    MPI_Datatype mine = tile_block_type(g, c, halo);
+    MPI_Irecv(tile,1,mine,0,0,g.cart,&req);
+    MPI_Type_free(&mine);
+    requests.push_back(req);
+    if(g.rank==0){
+        int n;
+        MPI_Comm_size(g.cart, &n);
+        for(int q=0;q<n;q++){
+            int x0, x1, y0, y1;
+            block_of(g, q, x0, x1, y0, y1);
+            MPI_Datatype t = region_type(g.height, g.width, c, y0, x0, y1-y0, x1-x0);
+            MPI_Isend(full,1,t,q,0,g.cart,&req);
+            MPI_Type_free(&t);
+            requests.push_back(req);
         }
     }
+    MPI_Waitall(requests.size(), requests.data(), MPI_STATUSES_IGNORE);
+}
 
-    std::vector<unsigned char> local_rgb(myrows*width*channels);
-    MPI_Scatterv(full_img,sendcounts.data(),displs.data(),MPI_UNSIGNED_CHAR,
-                 local_rgb.data(),local_rgb.size(),MPI_UNSIGNED_CHAR,
-                 0,MPI_COMM_WORLD);
-
-    if(rank==0){ stbi_image_free(full_img); }
-
-    std::vector<unsigned char> local_gray(myrows*width);
-    for(int y=0;y<myrows;y++)
-        for(int x=0;x<width;x++){
-            int idx=(y*width+x)*channels;
-            local_gray[y*width+x]=to_gray_uc(local_rgb[idx],local_rgb[idx+1],local_rgb[idx+2]);
+// Collects every rank's block from its tile into full on rank 0.
+void gather_blocks(const unsigned char* tile, int halo, unsigned char* full, int c, const BlockGrid& g)
+{
+    std::vector<MPI_Request> requests;
+    MPI_Request req;
+    if(g.rank==0){
+        int n;
+        MPI_Comm_size(g.cart, &n);
+        for(int q=0;q<n;q++){
+            int x0, x1, y0, y1;
+            block_of(g, q, x0, x1, y0, y1);
+            MPI_Datatype t = region_type(g.height, g.width, c, y0, x0, y1-y0, x1-x0);
+            MPI_Irecv(full,1,t,q,0,g.cart,&req);
+            MPI_Type_free(&t);
+            requests.push_back(req);
         }
+    }
+    MPI_Datatype mine = tile_block_type(g, c, halo);
+    MPI_Isend(tile,1,mine,0,0,g.cart,&req);
+    MPI_Type_free(&mine);
+    requests.push_back(req);
+    MPI_Waitall(requests.size(), requests.data(), MPI_STATUSES_IGNORE);
+}
 
-    std::vector<int> recvcounts(size), displs2(size);
-    if(rank==0){
-        int off=0;
-        for(int r=0;r<size;r++){
-            int rows = base + (r<rem?1:0);
-            recvcounts[r]=rows*width;
-            displs2[r]=off;
-            off+=recvcounts[r];
-        }
+// Fills the halo that no neighbour sends, the pixels beyond the image edge, through
+// the border policy. Columns go first, on every tile row that holds pixels; then the
+// missing rows are copied whole from the rows they map to, corners included. The
+// grid keeps split blocks at least R deep, so every mapped pixel is in the tile.
+template <class Border>
+void fill_edge_halo(unsigned char* tile, int c, int R, const BlockGrid& g)
+{
+    const int bw=g.block_w(), bh=g.block_h(), tw=bw+2*R, th=bh+2*R;
+    const size_t tile_row=(size_t)tw*c;
+    const bool top=g.neighbours[1]==MPI_PROC_NULL, bottom=g.neighbours[7]==MPI_PROC_NULL;
+    const bool left=g.neighbours[3]==MPI_PROC_NULL, right=g.neighbours[5]==MPI_PROC_NULL;
+
+    for(int j=top?R:0; j<(bottom?R+bh:th); j++){
+        unsigned char* p = tile + j*tile_row;
+        auto fill=[&](int i){
+            const int m = Border::map(g.x0-R+i, g.width);
+            if(m<0) std::fill(p+i*c, p+(i+1)*c, 0);
+            else std::copy(p+(m-g.x0+R)*c, p+(m-g.x0+R+1)*c, p+i*c);
+        };
+        if(left) for(int i=0;i<R;i++) fill(i);
+        if(right) for(int i=R+bw;i<tw;i++) fill(i);
     }
-    std::vector<unsigned char> full_gray;
-    if(rank==0) full_gray.resize(width*height);
+    auto fill_row=[&](int j){
+        const int m = Border::map(g.y0-R+j, g.height);
+        unsigned char* dst = tile + j*tile_row;
+        if(m<0) std::fill(dst, dst+tile_row, 0);
+        else { const unsigned char* src = tile + (m-g.y0+R)*tile_row; std::copy(src, src+tile_row, dst); }
+    };
+    if(top) for(int j=0;j<R;j++) fill_row(j);
+    if(bottom) for(int j=R+bh;j<th;j++) fill_row(j);
+}
 
-    MPI_Gatherv(local_gray.data(),local_gray.size(),MPI_UNSIGNED_CHAR,
-                full_gray.data(),recvcounts.data(),displs2.data(),
-                MPI_UNSIGNED_CHAR,0,MPI_COMM_WORLD);
 
-    double t_proc_stop = MPI_Wtime(); 
-    timing.process_ms = (t_proc_stop - t_proc_start) * 1000.0;
+// A halo exchange in flight: post_halos starts it, wait_halos completes it. In
+// between, the rank computes the pixels that do not reach into the halo.
+struct HaloExchange {
+    std::vector<MPI_Request> requests;
+};
 
-    
-    double t_export_start = MPI_Wtime();
-    if(rank==0){
-        stbi_write_png(output_path.c_str(),width,height,1,full_gray.data(),width);
-    }
-    double t_export_stop = MPI_Wtime(); 
-    timing.export_ms = (t_export_stop - t_export_start) * 1000.0;
+// Posts, for each of the up to eight neighbours, the receive of its edge pixels
+// into the matching part of tile's R-pixel halo and the send of this block's own
+// edge pixels to it. The tile must stay untouched until wait_halos.
+HaloExchange post_halos(unsigned char* tile, int c, int R, const BlockGrid& g)
+{
+    HaloExchange x;
+    if(R==0) return x;
+    const int bw=g.block_w(), bh=g.block_h(), tw=bw+2*R, th=bh+2*R;
+    // Start and extent along one axis of the halo part towards d (-1, 0, 1), and of
+    // the block's own pixels that the neighbour there needs.
+    auto halo_span=[&](int d, int n, int& at, int& len){ at = d<0 ? 0 : (d==0 ? R : R+n); len = d==0 ? n : R; };
+    auto edge_span=[&](int d, int n, int& at, int& len){ at = d>0 ? n : R; len = d==0 ? n : R; };
+    for(int dy=-1;dy<=1;dy++)
+        for(int dx=-1;dx<=1;dx++){
+            const int dir = (dy+1)*3+dx+1, nb = g.neighbours[dir];
+            if(nb==MPI_PROC_NULL) continue;
+            int y, rows, xx, cols;
+            MPI_Request req;
+            // A message is tagged with the direction it travels in, so on a two-block
+            // torus, where both sides are the same rank, each lands in the right place.
+            halo_span(dy, bh, y, rows); halo_span(dx, bw, xx, cols);
+            MPI_Datatype in = region_type(th, tw, c, y, xx, rows, cols);
+            MPI_Irecv(tile,1,in,nb,8-dir,g.cart,&req);
+            MPI_Type_free(&in);
+            x.requests.push_back(req);
+            edge_span(dy, bh, y, rows); edge_span(dx, bw, xx, cols);
+            MPI_Datatype out = region_type(th, tw, c, y, xx, rows, cols);
+            MPI_Isend(tile,1,out,nb,dir,g.cart,&req);
+            MPI_Type_free(&out);
+            x.requests.push_back(req);
+        }
+    return x;
 }
 
+// Waits for the exchange, then fills the halo beyond the image edge.
+void wait_halos(HaloExchange& x, unsigned char* tile, int c, int R, const BlockGrid& g, BorderMode border)
+{
+    MPI_Waitall(x.requests.size(), x.requests.data(), MPI_STATUSES_IGNORE);
+    if(R==0) return;
+    dispatch_border(border, [&](auto policy) {
+        fill_edge_halo<decltype(policy)>(tile, c, R, g);
+    });
+}
 
-void mpi_sobel(const std::string &input_path, const std::string &output_path,
-               int rank, int size,
-               ImageTiming& timing)
+// Blocking exchange, for passes where every pixel needs the halo.
+void exchange_halos(unsigned char* tile, int c, int R, const BlockGrid& g, BorderMode border)
 {
-    int width=0, height=0, channels=3;
-    unsigned char *full_img=nullptr;
-    double t0, t1;
+    HaloExchange x = post_halos(tile, c, R, g);
+    wait_halos(x, tile, c, R, g, border);
+}
 
-    t0 = MPI_Wtime();
-    if(rank==0){
-        full_img = stbi_load(input_path.c_str(), &width, &height, &channels, 3);
-        if(!full_img){ std::cerr<<"Failed to load "<<input_path<<"\n"; MPI_Abort(MPI_COMM_WORLD,1); }
-        channels = 3;
+// Runs rect(x0, x1, y0, y1), in block pixels, over the whole block around an
+// exchange posted by post_halos: first the interior, at least R from every block
+// edge, then, once the halo is in, the R-pixel frame around it. The interior goes
+// in a few bands with MPI_Testall between them, since most MPI libraries only
+// advance large (rendezvous) messages from inside an MPI call.
+template <typename Rect>
+void overlap_halos(HaloExchange& x, unsigned char* tile, int c, int R, const BlockGrid& g, BorderMode border,
+                   const Rect& rect)
+{
+    const int bw=g.block_w(), bh=g.block_h();
+    const int ix0 = std::min(R, bw), ix1 = std::max(bw-R, ix0);
+    const int iy0 = std::min(R, bh), iy1 = std::max(bh-R, iy0);
+    auto run=[&](int x0, int x1, int y0, int y1){ if(x0<x1 && y0<y1) rect(x0, x1, y0, y1); };
+    const int bands = 4, step = std::max((iy1-iy0+bands-1)/bands, 1);
+    for(int y=iy0;y<iy1 && ix0<ix1;y+=step){
+        run(ix0, ix1, y, std::min(y+step, iy1));
+        int done;
+        MPI_Testall(x.requests.size(), x.requests.data(), &done, MPI_STATUSES_IGNORE);
     }
-    t1 = MPI_Wtime(); 
-    timing.load_ms = (t1-t0) * 1000.0;
+    wait_halos(x, tile, c, R, g, border);
+    run(0, bw, 0, iy0);
+    run(0, bw, iy1, bh);
+    run(0, ix0, iy0, iy1);
+    run(ix1, bw, iy0, iy1);
+}
 
-    double t_proc_start = MPI_Wtime();
 
-    MPI_Bcast(&width,1,MPI_INT,0,MPI_COMM_WORLD);
-    MPI_Bcast(&height,1,MPI_INT,0,MPI_COMM_WORLD);
-    MPI_Bcast(&channels,1,MPI_INT,0,MPI_COMM_WORLD);
+// One input file as rank 0 found it: its path, its size from the image header
+// (0 x 0 if stb cannot read it) and its length on disk (-1 if unreadable). Every
+// rank has the whole list before the batch starts, so none of them waits on rank 0
+// to learn the size of the next image.
+struct ManifestEntry {
+    std::string path;
+    int width = 0, height = 0;
+    long long bytes = -1;
+};
 
-    int base=height/size, rem=height%size;
-    int myrows = base + (rank<rem?1:0);
+// Probes path's header and length without decoding it.
+ManifestEntry probe_file(const std::string& path)
+{
+    ManifestEntry e;
+    e.path = path;
+    int c = 0;
+    if(!stbi_info(path.c_str(), &e.width, &e.height, &c)) e.width = e.height = 0;
+    std::error_code ec;
+    const auto n = fs::file_size(path, ec);
+    if(!ec) e.bytes = (long long)n;
+    return e;
+}
 
-    std::vector<int> sendcounts(size), displs(size);
+// Sends rank 0's manifest to every rank as one buffer, packed per file as bytes,
+// width, height, path length and path: two broadcasts for the whole batch in place
+// of two per path. False on every rank if the packed manifest is too long for one
+// MPI_Bcast count.
+bool broadcast_manifest(std::vector<ManifestEntry>& files, int rank)
+{
+    std::vector<char> buf;
+    auto put = [&](const void* p, size_t n) {
+        buf.insert(buf.end(), (const char*)p, (const char*)p + n);
+    };
     if(rank==0){
-        int off=0;
-        for(int r=0;r<size;r++){
-            int rows = base + (r<rem?1:0);
-            sendcounts[r]=rows*width*channels;
-            displs[r]=off;
-            off+=sendcounts[r];
+        for(const ManifestEntry& e : files){
+            const int len = (int)e.path.size();
+            put(&e.bytes, sizeof e.bytes);
+            put(&e.width, sizeof e.width);
+            put(&e.height, sizeof e.height);
+            put(&len, sizeof len);
+            put(e.path.data(), len);
         }
     }
+    long long n = (long long)buf.size();
+    MPI_Bcast(&n,1,MPI_LONG_LONG,0,MPI_COMM_WORLD);
+    if(n > INT_MAX) return false;
+    buf.resize(n);
+    MPI_Bcast(buf.data(),(int)n,MPI_CHAR,0,MPI_COMM_WORLD);
+    if(rank==0) return true;
+
+    files.clear();
+    const char* p = buf.data();
+    auto get = [&](void* out, size_t k) { std::memcpy(out, p, k); p += k; };
+    while(p < buf.data() + n){
+        ManifestEntry e;
+        int len = 0;
+        get(&e.bytes, sizeof e.bytes);
+        get(&e.width, sizeof e.width);
+        get(&e.height, sizeof e.height);
+        get(&len, sizeof len);
+        e.path.assign(p, len);
+        p += len;
+        files.push_back(std::move(e));
+    }
+    return true;
+}
 
-    std::vector<unsigned char> local_rgb(myrows*width*channels);
-    MPI_Scatterv(full_img,sendcounts.data(),displs.data(),MPI_UNSIGNED_CHAR,
-                 local_rgb.data(),local_rgb.size(),MPI_UNSIGNED_CHAR,
-                 0,MPI_COMM_WORLD);
-    if(rank==0) stbi_image_free(full_img);
+// The --speed-profile file for --balance=speed: one line per host, operation and
+// number of ranks on that host, "<host> <operation> <ranks> <pixels per ms>", with
+// the speed one of those ranks ran the operation at. The key is everything before
+// the speed. A missing or unreadable file is an empty profile.
+std::map<std::string, double> read_speed_profile(const std::string& path)
+{
+    std::map<std::string, double> profile;
+    std::ifstream f(path);
+    std::string line;
+    while(std::getline(f, line)){
+        const size_t cut = line.rfind(' ');
+        if(cut==std::string::npos) continue;
+        try { profile[line.substr(0, cut)] = std::stod(line.substr(cut+1)); }
+        catch(const std::exception&) {}
+    }
+    return profile;
+}
 
+bool write_speed_profile(const std::string& path, const std::map<std::string, double>& profile)
+{
+    std::ofstream f(path);
+    for(const auto& [key, speed] : profile) f << key << ' ' << speed << '\n';
+    return (bool)f;
+}
 
-    std::vector<unsigned char> local_gray(myrows*width);
-    for(int y=0;y<myrows;y++)
-        for(int x=0;x<width;x++){
-            int idx=(y*width+x)*channels;
-            local_gray[y*width+x]=to_gray_uc(local_rgb[idx],local_rgb[idx+1],local_rgb[idx+2]);
-        }
+// Where an image is decoded and encoded. Root: rank 0 decodes it, scatters raw
+// pixels, gathers the result and writes the PNG, while the other ranks wait.
+// Ranks: rank 0 broadcasts the compressed file, every rank decodes it and keeps
+// its own block, and every rank encodes a strip of the output rows that it writes
+// into the PNG itself through MPI-IO.
+enum class Codec { Root, Ranks };
 
+bool parse_codec(const std::string& s, Codec& out)
+{
+    if(s=="root") out = Codec::Root;
+    else if(s=="ranks") out = Codec::Ranks;
+    else return false;
+    return true;
+}
 
-    std::vector<unsigned char> top(width), bottom(width);
-    int above=(rank==0)?MPI_PROC_NULL:rank-1;
-    int below=(rank==size-1)?MPI_PROC_NULL:rank+1;
+// Decodes the image as RGB on rank 0 (Codec::Root) or on every rank of comm
+// (Codec::Ranks). Its size comes from the manifest, so no rank waits on the decode
+// to learn it; a file that does not decode to that size aborts the run. stb cannot
+// decode part of a PNG or JPEG, so with Codec::Ranks each rank decodes all of it,
+// all at once, in place of waiting for a scatter of three bytes per pixel.
+unsigned char* load_rgb(const ManifestEntry& file, MPI_Comm comm, int rank, Codec codec, int& width, int& height)
+{
+    width = file.width;
+    height = file.height;
+    int w = 0, h = 0, channels = 3;
+    unsigned char* img = nullptr;
+    if(codec==Codec::Root){
+        if(rank!=0) return nullptr;
+        img = stbi_load(file.path.c_str(), &w, &h, &channels, 3);
+    }
+    else {
+        // Every rank knows the length, which main has checked fits an int, so rank 0
+        // only has to send the bytes. If it cannot, it aborts the run while the others
+        // wait in the broadcast.
+        std::vector<unsigned char> bytes;
+        if(rank==0){
+            std::ifstream f(file.path, std::ios::binary);
+            if(f) bytes.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+            if(!f.is_open() || (long long)bytes.size()!=file.bytes){
+                std::cerr<<"Failed to load "<<file.path<<"\n";
+                MPI_Abort(MPI_COMM_WORLD,1);
+            }
+        }
+        if(file.bytes>=0){
+            bytes.resize(file.bytes);
+            MPI_Bcast(bytes.data(),(int)file.bytes,MPI_UNSIGNED_CHAR,0,comm);
+            img = stbi_load_from_memory(bytes.data(), (int)file.bytes, &w, &h, &channels, 3);
+        }
+    }
+    // With Codec::Ranks every rank decoded the same bytes, so they all fail together.
+    if(!img || w!=width || h!=height){
+        if(rank==0) std::cerr<<"Failed to load "<<file.path<<"\n";
+        MPI_Abort(MPI_COMM_WORLD,1);
+    }
+    return img;
+}
 
-    MPI_Sendrecv(local_gray.data(),width,MPI_UNSIGNED_CHAR,above,0,
-                 top.data(),width,MPI_UNSIGNED_CHAR,above,1,
-                 MPI_COMM_WORLD,MPI_STATUS_IGNORE);
-    MPI_Sendrecv(local_gray.data()+(myrows-1)*width,width,MPI_UNSIGNED_CHAR,below,1,
-                 bottom.data(),width,MPI_UNSIGNED_CHAR,below,0,
-                 MPI_COMM_WORLD,MPI_STATUS_IGNORE);
+// Puts this rank's block of full, from load_rgb, into its tile: scattered from
+// rank 0, or copied out of the rank's own decode.
+void distribute_blocks(const unsigned char* full, int c, unsigned char* tile, int halo, const BlockGrid& g,
+                       Codec codec)
+{
+    if(codec==Codec::Root){ scatter_blocks(full, c, tile, halo, g); return; }
+    const int bw=g.block_w(), bh=g.block_h();
+    const size_t tile_row=(size_t)(bw+2*halo)*c, block_row=(size_t)bw*c;
+    #pragma omp parallel for schedule(static)
+    for(int y=0;y<bh;y++){
+        const unsigned char* src = full + ((size_t)(g.y0+y)*g.width + g.x0)*c;
+        std::copy(src, src+block_row, tile + (y+halo)*tile_row + (size_t)halo*c);
+    }
+}
 
+// The output rows a rank encodes: the whole image on rank 0 with Codec::Root, a
+// strip of rows [first, last) per rank with Codec::Ranks, preceded by the row
+// above the strip (when there is one), which PNG's row filters read.
+struct OutputRows {
+    std::vector<unsigned char> pixels;
+    int first = 0, last = 0;
+    bool above = false;
+};
 
-    std::vector<unsigned char> local_edge(myrows*width);
-    const int R_SOBEL = 1; 
+// Rows [first, last) of the image that grid rank q encodes with Codec::Ranks.
+void strip_of(const BlockGrid& g, int q, int& first, int& last)
+{
+    first = g.strips[q];
+    last = g.strips[q+1];
+}
 
-    auto get_gray=[&](int y,int x)->unsigned char{
-        if(y<0) return top[x];
-        if(y>=myrows) return bottom[x];
-        if(x<0) x=0; if(x>=width) x=width-1;
-        return local_gray[y*width+x];
-    };
+// Moves the blocks, each in its tile with `halo` pixels per side, to the ranks
+// that encode them.
+OutputRows collect_rows(const unsigned char* tile, int halo, int c, const BlockGrid& g, Codec codec)
+{
+    OutputRows out;
+    if(codec==Codec::Root){
+        if(g.rank==0){ out.last = g.height; out.pixels.resize((size_t)g.width*g.height*c); }
+        gather_blocks(tile, halo, out.pixels.data(), c, g);
+        return out;
+    }
+    strip_of(g, g.rank, out.first, out.last);
+    out.above = out.first>0 && out.first<out.last;
+    const int top = out.first - out.above;
+    out.pixels.resize((size_t)(out.last-top)*g.width*c);
+
+    // One message each way between every pair of ranks whose block and strip
+    // (with the row above it) overlap.
+    int n;
+    MPI_Comm_size(g.cart, &n);
+    std::vector<int> counts_out(n,0), counts_in(n,0), displs(n,0);
+    std::vector<MPI_Datatype> types_out(n,MPI_BYTE), types_in(n,MPI_BYTE);
+    for(int q=0;q<n;q++){
+        int f, l;
+        strip_of(g, q, f, l);
+        const int y0 = std::max(g.y0, f - (f>0 && f<l)), y1 = std::min(g.y1, l);
+        if(y0<y1){
+            types_out[q] = region_type(g.block_h()+2*halo, g.block_w()+2*halo, c, y0-g.y0+halo, halo,
+                                       y1-y0, g.block_w());
+            counts_out[q] = 1;
+        }
+        int x0, x1, by0, by1;
+        block_of(g, q, x0, x1, by0, by1);
+        const int r0 = std::max(by0, top), r1 = std::min(by1, out.last);
+        if(r0<r1){
+            types_in[q] = region_type(out.last-top, g.width, c, r0-top, x0, r1-r0, x1-x0);
+            counts_in[q] = 1;
+        }
+    }
+    MPI_Alltoallw(tile, counts_out.data(), displs.data(), types_out.data(),
+                  out.pixels.data(), counts_in.data(), displs.data(), types_in.data(), g.cart);
+    for(int q=0;q<n;q++){
+        if(counts_out[q]) MPI_Type_free(&types_out[q]);
+        if(counts_in[q]) MPI_Type_free(&types_in[q]);
+    }
+    return out;
+}
 
-    for(int y=0;y<myrows;y++){
-        for(int x=0;x<width;x++){
-            float gx=0,gy=0; int idx=0;
-            for(int ky_= -R_SOBEL;ky_<=R_SOBEL;ky_++)
-                for(int kx_= -R_SOBEL;kx_<=R_SOBEL;kx_++){
-                    unsigned char v=get_gray(y+ky_,x+kx_);
-                    gx+=v*sobel_x[idx]; gy+=v*sobel_y[idx]; idx++;
-                }
-            local_edge[y*width+x]=clamp_uc(std::sqrt(gx*gx+gy*gy));
+// Bits up to and including the end-of-block code of a deflate stream holding the
+// single fixed-Huffman block that stb's compressor writes.
+size_t fixed_block_bits(const unsigned char* d)
+{
+    size_t pos = 3;
+    auto bits=[&](int n){ unsigned v=0; for(int i=0;i<n;i++,pos++) v = v<<1 | ((d[pos>>3]>>(pos&7))&1); return v; };
+    for(;;){
+        unsigned code = bits(7);
+        int sym;
+        if(code<=0x17) sym = 256+code;
+        else {
+            code = code<<1 | bits(1);
+            if(code>=0x30 && code<=0xBF) sym = code-0x30;
+            else if(code>=0xC0 && code<=0xC7) sym = 280+code-0xC0;
+            else sym = 144 + (int)((code<<1 | bits(1)) - 0x190);
         }
+        if(sym==256) return pos;
+        if(sym<256) continue;
+        // Length extra bits, distance code, distance extra bits.
+        const int len = sym-257;
+        pos += len<8 || len==28 ? 0 : (len-4)/4;
+        const unsigned dist = bits(5);
+        pos += dist<4 ? 0 : (dist-2)/2;
     }
+}
 
+// Adler-32 of A followed by B, from the checksums of both and B's length.
+uint32_t adler32_combine(uint32_t a, uint32_t b, uint64_t len_b)
+{
+    const uint32_t base = 65521;
+    const uint32_t rem = (uint32_t)(len_b % base);
+    const uint32_t a1 = a & 0xffff, a2 = a >> 16, b1 = b & 0xffff, b2 = b >> 16;
+    const uint32_t s1 = (a1 + b1 + base - 1) % base;
+    const uint32_t s2 = (uint32_t)(((uint64_t)rem*a1 + a2 + b2 + base - rem) % base);
+    return s1 | s2 << 16;
+}
 
-    std::vector<int> recvcounts(size), displs2(size);
-    if(rank==0){
-        int off=0;
-        for(int r=0;r<size;r++){
-            int rows = base + (r<rem?1:0);
-            recvcounts[r]=rows*width;
-            displs2[r]=off;
-            off+=recvcounts[r];
+// Rows of one piece of a PNG, filtered and deflated on their own. Unless the
+// piece ends the image, its last block is made non-final and followed by an empty
+// stored block, which pads it to a byte, so the next piece's deflate data can
+// simply follow. The row before rows is read for the filters unless first.
+struct DeflatedRows {
+    std::vector<unsigned char> data;  // deflate data, without zlib header or checksum
+    uint32_t adler = 1;               // Adler-32 of the filtered rows
+    uint64_t length = 0;              // bytes of filtered rows
+};
+
+DeflatedRows deflate_rows(const unsigned char* rows, int width, int c, int count, bool first, bool last)
+{
+    DeflatedRows out;
+    if(count<=0) return out;
+    const size_t stride=(size_t)width*c;
+    out.length = (uint64_t)count*(stride+1);
+    std::vector<unsigned char> filt(out.length);
+    std::vector<signed char> line(stride);
+    // The same per-row choice of filter as stbi_write_png: the smallest sum of |v|.
+    unsigned char* base = const_cast<unsigned char*>(rows) - (first ? 0 : stride);
+    for(int j=0;j<count;j++){
+        const int y = j + !first;
+        int best=0, best_est=0x7fffffff;
+        for(int f=0;f<5;f++){
+            stbiw__encode_png_line(base, (int)stride, width, count+1, y, c, f, line.data());
+            int est=0;
+            for(size_t i=0;i<stride;i++) est += std::abs((int)line[i]);
+            if(est<best_est){ best_est=est; best=f; }
         }
+        stbiw__encode_png_line(base, (int)stride, width, count+1, y, c, best, line.data());
+        filt[j*(stride+1)] = (unsigned char)best;
+        std::copy(line.begin(), line.end(), filt.begin() + j*(stride+1) + 1);
+    }
+
+    int zlen=0;
+    unsigned char* z = stbi_zlib_compress(filt.data(), (int)out.length, &zlen, stbi_write_png_compression_level);
+    const unsigned char* t = z + zlen - 4;
+    out.adler = (uint32_t)t[0]<<24 | (uint32_t)t[1]<<16 | (uint32_t)t[2]<<8 | t[3];
+    unsigned char* d = z + 2;
+    const size_t n = zlen - 6;
+    const bool stored = ((d[0]>>1)&3)==0;
+    size_t pad = 0;
+    if(!last && stored){
+        // Stored blocks, which stb falls back to when compression does not pay:
+        // clear BFINAL on the last one. It already ends on a byte.
+        size_t at = 0;
+        while(!(d[at]&1)) at += 5 + (d[at+1] | d[at+2]<<8);
+        d[at] = 0;
     }
+    if(!last && !stored){
+        d[0] &= ~1;
+        pad = (8 - fixed_block_bits(d)%8) % 8;
+    }
+    out.data.assign(d, d+n);
+    if(!last && !stored){
+        // The empty stored block's 3 header bits go in the padding if it has room.
+        if(pad<3) out.data.push_back(0);
+        out.data.insert(out.data.end(), {0, 0, 0xff, 0xff});
+    }
+    STBIW_FREE(z);
+    return out;
+}
 
-    std::vector<unsigned char> full_edge;
-    if(rank==0) full_edge.resize(width*height);
+// A PNG chunk: length, type, data, CRC of type and data.
+std::vector<unsigned char> png_chunk(const char* type, const unsigned char* data, size_t n)
+{
+    std::vector<unsigned char> chunk(n+12);
+    unsigned char* o = chunk.data();
+    stbiw__wp32(o, (unsigned)n);
+    stbiw__wptag(o, type);
+    std::copy(data, data+n, o);
+    o += n;
+    stbiw__wpcrc(&o, (int)n);
+    return chunk;
+}
 
-    MPI_Gatherv(local_edge.data(),local_edge.size(),MPI_UNSIGNED_CHAR,
-                full_edge.data(),recvcounts.data(),displs2.data(),
-                MPI_UNSIGNED_CHAR,0,MPI_COMM_WORLD);
+// Encodes the rows from collect_rows into output_path. With Codec::Ranks every
+// rank deflates its strip, split further across its threads, and writes it as one
+// IDAT chunk at its offset in the file; rank 0 adds the header, the zlib header
+// and, once it has every strip's checksum, the Adler-32 and the end chunk.
+void write_rows(const OutputRows& rows, int c, const BlockGrid& g, Codec codec, const std::string& output_path)
+{
+    const int width=g.width;
+    if(codec==Codec::Root){
+        if(g.rank==0) stbi_write_png(output_path.c_str(),width,g.height,c,rows.pixels.data(),width*c);
+        return;
+    }
+    const size_t stride=(size_t)width*c;
+    const unsigned char* own = rows.pixels.data() + (rows.above ? stride : 0);
+    const int count = rows.last - rows.first;
+    int threads = 1;
+#ifdef _OPENMP
+    threads = omp_get_max_threads();
+#endif
+    // Each piece restarts the compressor's window, so pieces stay a few dozen rows.
+    const int pieces = std::max(1, std::min(threads, count/32));
+    std::vector<DeflatedRows> part(pieces);
+    #pragma omp parallel for schedule(dynamic)
+    for(int p=0;p<pieces;p++){
+        int a, b;
+        split_range(count, pieces, p, a, b);
+        part[p] = deflate_rows(own + a*stride, width, c, b-a,
+                               rows.first+a==0, rows.first+b==g.height);
+    }
+    std::vector<unsigned char> data;
+    uint64_t sums[2] = {1, 0};  // Adler-32 and length of this rank's filtered rows
+    for(const DeflatedRows& d : part){
+        data.insert(data.end(), d.data.begin(), d.data.end());
+        sums[0] = adler32_combine((uint32_t)sums[0], d.adler, d.length);
+        sums[1] += d.length;
+    }
+    std::vector<unsigned char> chunk;
+    if(!data.empty()) chunk = png_chunk("IDAT", data.data(), data.size());
+
+    int n;
+    MPI_Comm_size(g.cart, &n);
+    std::vector<uint64_t> all(g.rank==0 ? 2*n : 0);
+    MPI_Gather(sums,2,MPI_UINT64_T,all.data(),2,MPI_UINT64_T,0,g.cart);
+    long long bytes = chunk.size(), offset = 0, total = 0;
+    MPI_Exscan(&bytes,&offset,1,MPI_LONG_LONG,MPI_SUM,g.cart);
+    MPI_Reduce(&bytes,&total,1,MPI_LONG_LONG,MPI_SUM,0,g.cart);
+    if(g.rank==0) offset = 0;
+
+    std::vector<unsigned char> head, tail;
+    if(g.rank==0){
+        unsigned char ihdr[13], *o = ihdr;
+        static const int ctype[5] = {-1, 0, 4, 2, 6};
+        stbiw__wp32(o, (unsigned)width);
+        stbiw__wp32(o, (unsigned)g.height);
+        stbiw__wpng4(o, 8, ctype[c], 0, 0);
+        *o = 0;
+        static const unsigned char sig[8] = {137,80,78,71,13,10,26,10}, zhead[2] = {0x78, 0x5e};
+        head.assign(sig, sig+8);
+        for(auto& ch : {png_chunk("IHDR", ihdr, 13), png_chunk("IDAT", zhead, 2)})
+            head.insert(head.end(), ch.begin(), ch.end());
+        head.insert(head.end(), chunk.begin(), chunk.end());
+        chunk.swap(head);
+
+        uint32_t adler = 1;
+        for(int q=0;q<n;q++) adler = adler32_combine(adler, (uint32_t)all[2*q], all[2*q+1]);
+        unsigned char sum[4], *s = sum;
+        stbiw__wp32(s, adler);
+        tail = png_chunk("IDAT", sum, 4);
+        const std::vector<unsigned char> iend = png_chunk("IEND", nullptr, 0);
+        tail.insert(tail.end(), iend.begin(), iend.end());
+    }
+    // Signature, IHDR and the IDAT with the zlib header come before the strips.
+    const long long head_bytes = 8 + 25 + 14;
+    const long long start = g.rank==0 ? 0 : head_bytes + offset;
+
+    MPI_File fh;
+    if(MPI_File_open(g.cart, output_path.c_str(), MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &fh)!=MPI_SUCCESS){
+        if(g.rank==0) std::cerr<<"Failed to write "<<output_path<<"\n";
+        return;
+    }
+    MPI_File_set_size(fh, 0);
+    MPI_File_write_at_all(fh, start, chunk.data(), (int)chunk.size(), MPI_BYTE, MPI_STATUS_IGNORE);
+    if(g.rank==0)
+        MPI_File_write_at(fh, head_bytes + total, tail.data(), (int)tail.size(), MPI_BYTE, MPI_STATUS_IGNORE);
+    MPI_File_close(&fh);
+}
 
-    double t_proc_stop = MPI_Wtime(); 
-    timing.process_ms = (t_proc_stop - t_proc_start) * 1000.0;
+// With --writer-ranks, the blocks of an image go straight from the ranks that
+// computed them to the writer rank that encodes it, which these two sides of the
+// transfer address in MPI_COMM_WORLD.
 
+// Starts sending this rank's block, in its tile with `halo` pixels per side; the
+// tile must stay alive until the request completes.
+MPI_Request send_block(const unsigned char* tile, int halo, int c, const BlockGrid& g, int writer, int tag)
+{
+    MPI_Request req;
+    MPI_Datatype mine = tile_block_type(g, c, halo);
+    MPI_Isend(tile,1,mine,writer,tag,MPI_COMM_WORLD,&req);
+    MPI_Type_free(&mine);
+    return req;
+}
 
-    double t_export_start = MPI_Wtime();
-    if(rank==0){
-        stbi_write_png(output_path.c_str(),width,height,1,full_edge.data(),width);
+// Receives into full the blocks of a width x height image that make_grid split
+// over ranks 0 .. n-1 with the given halo and speed.
+void receive_blocks(unsigned char* full, int width, int height, int c, int n, int halo,
+                    const std::vector<double>& speed, int tag)
+{
+    int dims[2];
+    choose_grid(width, height, n, halo, dims);
+    std::vector<int> rows, cols;
+    grid_edges(width, height, dims, halo, speed, rows, cols);
+    std::vector<MPI_Request> requests(dims[0]*dims[1]);
+    for(int q=0;q<dims[0]*dims[1];q++){
+        const int y0 = rows[q/dims[1]], y1 = rows[q/dims[1]+1];
+        const int x0 = cols[q%dims[1]], x1 = cols[q%dims[1]+1];
+        MPI_Datatype t = region_type(height, width, c, y0, x0, y1-y0, x1-x0);
+        MPI_Irecv(full,1,t,q,tag,MPI_COMM_WORLD,&requests[q]);
+        MPI_Type_free(&t);
     }
-    double t_export_stop = MPI_Wtime(); // <-- End Export
-    timing.export_ms = (t_export_stop - t_export_start) * 1000.0;
+    MPI_Waitall(requests.size(), requests.data(), MPI_STATUSES_IGNORE);
 }
 
 
-void mpi_gaussian(const std::string &input_path, const std::string &output_path,
-                  int rank, int size,
-                  ImageTiming& timing)
+
+// With --transport=shared, the ranks of one node work on the image in place in
+// shared-memory windows that rank 0 allocates once, sized for the largest image:
+// rank 0 puts the decoded pixels in `in`, every rank filters its own rows, reading
+// whatever rows above and below it needs straight from the window, and writes them
+// to `out`. Only the image size goes through MPI.
+struct SharedImages {
+    MPI_Comm node = MPI_COMM_NULL;
+    std::vector<MPI_Win> windows;
+    unsigned char* in = nullptr;    // decoded RGB
+    unsigned char* out = nullptr;   // result, with room for 3 channels for box's passes
+    unsigned char* gray = nullptr;  // sobel's grayscale image
+    uint32_t* sums = nullptr;       // box's horizontal sums
+};
+
+// Collective over s.node: bytes of memory on rank 0 that every rank addresses
+// directly. Each window stays in a passive access epoch for its whole life.
+void* shared_window(SharedImages& s, size_t bytes)
 {
-    const int R = GAUSSIAN_RADIUS; // 4
-    const int K = KERNEL_SIZE_GAUSSIAN; // 9
+    int rank;
+    MPI_Comm_rank(s.node, &rank);
+    MPI_Win win;
+    void* base;
+    MPI_Win_allocate_shared(rank==0 ? (MPI_Aint)bytes : 0, 1, MPI_INFO_NULL, s.node, &base, &win);
+    MPI_Aint size;
+    int unit;
+    MPI_Win_shared_query(win, 0, &size, &unit, &base);
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, win);
+    s.windows.push_back(win);
+    return base;
+}
 
-    int width=0, height=0, channels=3;
-    unsigned char *full_img=nullptr;
-    double t0, t1;
+SharedImages make_shared_images(MPI_Comm node, size_t max_pixels, bool gray, bool sums)
+{
+    SharedImages s;
+    s.node = node;
+    s.in = (unsigned char*)shared_window(s, max_pixels*3);
+    s.out = (unsigned char*)shared_window(s, max_pixels*3);
+    if(gray) s.gray = (unsigned char*)shared_window(s, max_pixels);
+    if(sums) s.sums = (uint32_t*)shared_window(s, max_pixels*3*sizeof(uint32_t));
+    return s;
+}
 
-    t0 = MPI_Wtime();
-    if(rank==0){
-        full_img = stbi_load(input_path.c_str(), &width, &height, &channels, 3);
-        if(!full_img){ std::cerr<<"Failed to load "<<input_path<<"\n"; MPI_Abort(MPI_COMM_WORLD,1); }
-        channels = 3;
-    }
-    t1 = MPI_Wtime();
-    timing.load_ms = (t1-t0) * 1000.0;
+void free_shared_images(SharedImages& s)
+{
+    for(MPI_Win& w : s.windows){ MPI_Win_unlock_all(w); MPI_Win_free(&w); }
+    s.windows.clear();
+}
 
-    double t_proc_start = MPI_Wtime();
+// Makes every rank's writes to the windows so far visible to all of them.
+void shared_sync(const SharedImages& s)
+{
+    for(MPI_Win w : s.windows) MPI_Win_sync(w);
+    MPI_Barrier(s.node);
+    for(MPI_Win w : s.windows) MPI_Win_sync(w);
+}
 
-    MPI_Bcast(&width,1,MPI_INT,0,MPI_COMM_WORLD);
-    MPI_Bcast(&height,1,MPI_INT,0,MPI_COMM_WORLD);
-    MPI_Bcast(&channels,1,MPI_INT,0,MPI_COMM_WORLD);
+// An operation's result on one rank: its block inside a tile with `halo` pixels on
+// every side.
+struct BlockResult {
+    std::vector<unsigned char> tile;
+    int halo = 0;
+};
 
-    int base=height/size, rem=height%size;
-    int myrows = base + (rank<rem?1:0);
+// The operations run on the blocks of one image: each takes the decoded RGB image
+// (on rank 0, or on every rank with Codec::Ranks) and frees it once its block is in
+// place.
+BlockResult mpi_grayscale(unsigned char* full_img, const BlockGrid& grid, Codec codec)
+{
+    const int channels=3;
+    const size_t pixels = (size_t)grid.block_w()*grid.block_h();
 
-    std::vector<int> sendcounts(size), displs(size);
-    if(rank==0){
-        int off=0;
-        for(int r=0;r<size;r++){
-            int rows = base + (r<rem?1:0);
-            sendcounts[r]=rows*width*channels;
-            displs[r]=off;
-            off+=sendcounts[r];
-        }
-    }
+    std::vector<unsigned char> local_rgb(pixels*channels);
+    distribute_blocks(full_img, channels, local_rgb.data(), 0, grid, codec);
+    stbi_image_free(full_img);
 
-    std::vector<unsigned char> local_rgb(myrows*width*channels);
-    MPI_Scatterv(full_img,sendcounts.data(),displs.data(),MPI_UNSIGNED_CHAR,
-                 local_rgb.data(),local_rgb.size(),MPI_UNSIGNED_CHAR,
-                 0,MPI_COMM_WORLD);
-    if(rank==0) stbi_image_free(full_img);
+    std::vector<unsigned char> local_gray(pixels);
+    rgb_to_gray_parallel(local_rgb.data(), local_gray.data(), pixels);
 
+    return {std::move(local_gray), 0};
+}
 
- 
-    std::vector<unsigned char> top(width*channels*R), bottom(width*channels*R);
-    int above=(rank==0)?MPI_PROC_NULL:rank-1;
-    int below=(rank==size-1)?MPI_PROC_NULL:rank+1;
 
-    MPI_Sendrecv(local_rgb.data(),width*channels*R,MPI_UNSIGNED_CHAR,above,0,
-                 top.data(),width*channels*R,MPI_UNSIGNED_CHAR,above,1,
-                 MPI_COMM_WORLD,MPI_STATUS_IGNORE);
-    MPI_Sendrecv(local_rgb.data()+(myrows-R)*width*channels,width*channels*R,MPI_UNSIGNED_CHAR,below,1,
-                 bottom.data(),width*channels*R,MPI_UNSIGNED_CHAR,below,0,
-                 MPI_COMM_WORLD,MPI_STATUS_IGNORE);
+BlockResult mpi_sobel(unsigned char* full_img, const BlockGrid& grid, Codec codec, SobelNorm norm, BorderMode border)
+{
+    const int channels=3;
+    const int bw = grid.block_w(), bh = grid.block_h(), tw = bw+2;
+
+    std::vector<unsigned char> local_rgb((size_t)bw*bh*channels);
+    distribute_blocks(full_img, channels, local_rgb.data(), 0, grid, codec);
+    stbi_image_free(full_img);
+
+    // Gray block inside a one-pixel halo.
+    std::vector<unsigned char> tile((size_t)tw*(bh+2));
+    #pragma omp parallel for schedule(static)
+    for(int y=0;y<bh;y++)
+        rgb_to_gray_row(local_rgb.data()+(size_t)y*bw*channels, tile.data()+(size_t)(y+1)*tw+1, bw);
+
+    HaloExchange halo = post_halos(tile.data(), 1, 1, grid);
+
+    std::vector<unsigned char> local_edge((size_t)bw*bh);
+    overlap_halos(halo, tile.data(), 1, 1, grid, border, [&](int x0, int x1, int y0, int y1) {
+        #pragma omp parallel for schedule(static)
+        for(int y=y0;y<y1;y++){
+            const unsigned char* mid = tile.data()+(size_t)(y+1)*tw+1;
+            sobel_span(mid-tw, mid, mid+tw, local_edge.data()+(size_t)y*bw, x0, x1, norm, true);
+        }
+    });
 
-    std::vector<unsigned char> local_blur(myrows*width*channels);
+    return {std::move(local_edge), 0};
+}
 
-    auto get_rgb=[&](int y,int x,int c)->unsigned char{
-        if(y<0) return top[(R+y)*width*channels + x*channels + c];
-        if(y>=myrows) return bottom[(y-myrows)*width*channels + x*channels + c];
-        if(x<0) x=0; if(x>=width) x=width-1;
-        return local_rgb[y*width*channels + x*channels + c];
-    };
 
-    for(int y=0;y<myrows;y++){
-        for(int x=0;x<width;x++){
-            float acc[3]={0,0,0};
-            for(int ky=-R;ky<=R;ky++){
-                for(int kx=-R;kx<=R;kx++){
-                    float w = GAUSSIAN_9x9[(ky+R)*K + (kx+R)];
-                    for(int c=0;c<3;c++)
-                        acc[c] += get_rgb(y+ky,x+kx,c)*w;
+BlockResult mpi_gaussian(unsigned char* full_img, const BlockGrid& grid, Codec codec, bool separable,
+                         const GaussianKernel& gk, BorderMode border)
+{
+    const int R = gk.radius;
+    const int K = gk.size();
+    const int channels=3;
+    const int bw = grid.block_w(), bh = grid.block_h(), tw = bw+2*R;
+    const size_t tile_row = (size_t)tw*channels, out_row = (size_t)bw*channels;
+
+    std::vector<unsigned char> tile(tile_row*(bh+2*R));
+    distribute_blocks(full_img, channels, tile.data(), R, grid, codec);
+    stbi_image_free(full_img);
+
+    HaloExchange halo = post_halos(tile.data(), channels, R, grid);
+
+    std::vector<unsigned char> local_blur(out_row*bh);
+
+    // Row y of the block, y in [-R, bh + R), as a tile row: the block's columns start at R.
+    auto row=[&](int y)->const unsigned char*{ return tile.data() + (size_t)(y+R)*tile_row; };
+
+    if(separable){
+        dispatch_radius(R, [&](auto radius) {
+            overlap_halos(halo, tile.data(), channels, R, grid, border, [&](int x0, int x1, int y0, int y1) {
+                #pragma omp parallel
+                {
+                    SeparableScratch scratch;
+                    #pragma omp for schedule(static)
+                    for(int y=y0;y<y1;y++)
+                        gaussian_separable_tile<radius.value>(row, tw, channels, x0+R, x1+R, y, y+1, gk.w1d.data(), K,
+                                                              true, local_blur.data()+y*out_row+x0*channels, out_row,
+                                                              scratch);
                 }
-            }
-            for(int c=0;c<3;c++)
-                local_blur[y*width*channels + x*channels + c] = clamp_uc(acc[c]);
-        }
+            });
+        });
+    }
+    else {
+        overlap_halos(halo, tile.data(), channels, R, grid, border, [&](int x0, int x1, int y0, int y1) {
+            #pragma omp parallel for schedule(static)
+            for(int y=y0;y<y1;y++)
+                gaussian_direct_tile(row, tw, channels, x0+R, x1+R, y, y+1, gk.w2d.data(), K, true,
+                                     local_blur.data()+y*out_row+x0*channels, out_row);
+        });
     }
 
-    // Gather all RGB parts
-    std::vector<int> recvcounts(size), displs2(size);
-    if(rank==0){
-        int off=0;
-        for(int r=0;r<size;r++){
-            int rows = base + (r<rem?1:0);
-            recvcounts[r]=rows*width*channels;
-            displs2[r]=off;
-            off+=recvcounts[r];
+    return {std::move(local_blur), 0};
+}
+
+
+BlockResult mpi_box(unsigned char* full_img, const BlockGrid& grid, Codec codec, int r, int passes, BorderMode border)
+{
+    const int channels=3;
+    const int bw = grid.block_w(), bh = grid.block_h(), tw = bw+2*r, th = bh+2*r;
+    const size_t tile_row = (size_t)tw*channels;
+
+    // Each pass reads one tile and writes the block of the other, whose halo the
+    // next pass exchanges.
+    std::vector<unsigned char> src(tile_row*th), dst(tile_row*th);
+    distribute_blocks(full_img, channels, src.data(), r, grid, codec);
+    stbi_image_free(full_img);
+
+    std::vector<uint32_t> sums(tile_row*th);
+    const int strip_w = 64;
+    const int strips = (bw + strip_w - 1) / strip_w;
+    auto row=[&](int y)->const uint32_t*{ return sums.data() + (size_t)(y+r)*tile_row; };
+
+    for(int p=0;p<passes;p++){
+        exchange_halos(src.data(), channels, r, grid, border);
+        // Sums of every tile row; only the block's columns, whose windows lie inside
+        // the tile, are read back, so the policy for the tile's own edge is moot.
+        #pragma omp parallel
+        {
+            std::vector<unsigned char> line;
+            std::vector<uint32_t> acc;
+            #pragma omp for schedule(static)
+            for(int y=0;y<th;y++) box_sum_rows<BorderClamp>(src.data(), sums.data(), tw, channels, y, y+1, r, line);
+            #pragma omp for schedule(static)
+            for(int s=0;s<strips;s++){
+                const int x0 = r + s*strip_w;
+                box_mean_columns(row, dst.data()+r*tile_row, tw, bh, channels, x0, std::min(x0+strip_w, r+bw),
+                                 r, true, acc);
+            }
         }
+        src.swap(dst);
     }
 
-    std::vector<unsigned char> full_blur;
-    if(rank==0) full_blur.resize(width*height*channels);
+    return {std::move(src), r};
+}
 
-    MPI_Gatherv(local_blur.data(),local_blur.size(),MPI_UNSIGNED_CHAR,
-                full_blur.data(),recvcounts.data(),displs2.data(),
-                MPI_UNSIGNED_CHAR,0,MPI_COMM_WORLD);
 
-    double t_proc_stop = MPI_Wtime();
-    timing.process_ms = (t_proc_stop - t_proc_start) * 1000.0;
+// The operations on rows [y0, y1) of the w x h image in s.in, for --transport=shared.
+// Each returns the window holding the result.
+const unsigned char* shared_grayscale(const SharedImages& s, int w, int y0, int y1)
+{
+    rgb_to_gray_parallel(s.in + (size_t)y0*w*3, s.out + (size_t)y0*w, (size_t)(y1-y0)*w);
+    return s.out;
+}
 
-    double t_export_start = MPI_Wtime();
-    if(rank==0){
-        stbi_write_png(output_path.c_str(),width,height,channels,full_blur.data(),width*channels);
+template <class Border>
+const unsigned char* shared_sobel(const SharedImages& s, int w, int h, int y0, int y1, SobelNorm norm)
+{
+    rgb_to_gray_parallel(s.in + (size_t)y0*w*3, s.gray + (size_t)y0*w, (size_t)(y1-y0)*w);
+    shared_sync(s);
+    std::vector<unsigned char> zero_row(w, 0);
+    #pragma omp parallel for schedule(static)
+    for(int y=y0;y<y1;y++){
+        const unsigned char* above = border_row<Border>(s.gray, w, h, y-1, zero_row.data());
+        const unsigned char* below = border_row<Border>(s.gray, w, h, y+1, zero_row.data());
+        sobel_row<Border>(above, s.gray+(size_t)y*w, below, s.out+(size_t)y*w, w, norm, true);
+    }
+    return s.out;
+}
+
+template <class Border>
+const unsigned char* shared_gaussian(const SharedImages& s, int w, int h, int y0, int y1, bool separable,
+                                     const GaussianKernel& gk)
+{
+    const int c = 3;
+    const size_t stride = (size_t)w*c;
+    std::vector<unsigned char> zero_row(stride, 0);
+    auto row=[&](int y){ return border_row<Border>(s.in, stride, h, y, zero_row.data()); };
+    if(separable){
+        dispatch_radius(gk.radius, [&](auto radius) {
+            #pragma omp parallel
+            {
+                SeparableScratch scratch;
+                #pragma omp for schedule(static)
+                for(int y=y0;y<y1;y++)
+                    gaussian_separable_rows<radius.value, Border>(row, s.out+y*stride, w, c, y, y+1, gk.w1d.data(),
+                                                                  gk.size(), true, scratch);
+            }
+        });
+    }
+    else {
+        #pragma omp parallel for schedule(static)
+        for(int y=y0;y<y1;y++)
+            gaussian_direct_rows<Border>(row, s.out+y*stride, w, c, y, y+1, gk.w2d.data(), gk.size(), true);
     }
-    double t_export_stop = MPI_Wtime();
-    timing.export_ms = (t_export_stop - t_export_start) * 1000.0;
+    return s.out;
+}
+
+// The passes alternate between the two image windows, so `in` is overwritten from
+// the second pass on.
+template <class Border>
+const unsigned char* shared_box(const SharedImages& s, int w, int h, int y0, int y1, int r, int passes)
+{
+    const int c = 3;
+    const size_t stride = (size_t)w*c;
+    std::vector<uint32_t> zero_row(stride, 0);
+    auto row=[&](int y){ return border_row<Border>(s.sums, stride, h, y0+y, zero_row.data()); };
+    const int strip_w = 64;
+    const int strips = (w + strip_w - 1) / strip_w;
+    unsigned char *src = s.in, *dst = s.out;
+    for(int p=0;p<passes;p++){
+        #pragma omp parallel
+        {
+            std::vector<unsigned char> line;
+            #pragma omp for schedule(static)
+            for(int y=y0;y<y1;y++) box_sum_rows<Border>(src, s.sums, w, c, y, y+1, r, line);
+        }
+        shared_sync(s);
+        #pragma omp parallel
+        {
+            std::vector<uint32_t> acc;
+            #pragma omp for schedule(static)
+            for(int t=0;t<strips;t++)
+                box_mean_columns(row, dst+y0*stride, w, y1-y0, c, t*strip_w, std::min((t+1)*strip_w, w), r, true, acc);
+        }
+        // Next pass's sums overwrite these, and its means are read from dst.
+        shared_sync(s);
+        std::swap(src, dst);
+    }
+    return src;
 }
 
 
 int main(int argc, char** argv) {
-    MPI_Init(&argc, &argv);
+    int provided = MPI_THREAD_SINGLE;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
     int rank, size;
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
     MPI_Comm_size(MPI_COMM_WORLD, &size);
+#ifdef _OPENMP
+    if (provided < MPI_THREAD_FUNNELED) {
+        if (rank == 0) std::cerr << "MPI library does not support MPI_THREAD_FUNNELED; using one thread per rank\n";
+        omp_set_num_threads(1);
+    }
+    else if (!std::getenv("OMP_NUM_THREADS")) {
+        // Unless told otherwise, the ranks on a node share its cores: 64 ranks on 64
+        // cores run one thread each, one rank per NUMA domain gets the whole domain.
+        MPI_Comm node;
+        MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &node);
+        int local = 1;
+        MPI_Comm_size(node, &local);
+        MPI_Comm_free(&node);
+        const int cores = (int)std::max(1u, std::thread::hardware_concurrency());
+        omp_set_num_threads(std::max(1, std::min(omp_get_max_threads(), cores / local)));
+    }
+#endif
 
     if (argc < 4) {
         if (rank == 0)
             std::cerr << "Usage: mpirun -np <N> ./Proc_MPI <input_dir> <output_dir> <operation>\n"
-                      << "Operation: grayscale | gaussian | sobel\n";
+                      << "Operation: grayscale | gaussian | sobel | box\n"
+                      << "Options: --gaussian-impl=separable|direct --radius=<px> --sigma=<px>\n"
+                      << "         --simd=auto|avx512|avx2|sse4.1|scalar --sobel-norm=l2|l1|linf\n"
+                      << "         --border=clamp|reflect|wrap|constant --box-passes=<n>\n"
+                      << "         --distribute=blocks|images --codec=root|ranks\n"
+                      << "         --io-threads=<n> --max-inflight=<n> --max-memory=<MB> --writer-ranks=<n>\n"
+                      << "         --transport=messages|shared --balance=even|speed --speed-profile=<file>\n";
         MPI_Finalize();
         return 1;
     }
@@ -396,11 +1179,159 @@ int main(int argc, char** argv) {
     std::string output_dir = argv[2];
     std::string operation = argv[3];
 
+    Options opts;
+    try { opts = parse_options(argc, argv, 4); }
+    catch (const std::exception& e) {
+        if (rank == 0) std::cerr << e.what() << "\n";
+        MPI_Finalize();
+        return 1;
+    }
+
+    std::string gaussian_impl = opts.get("gaussian-impl", "separable");
+    if (gaussian_impl == "iir") {
+        // The recursions run the full image height and width, which the blocks split across ranks.
+        if (rank == 0) std::cerr << "--gaussian-impl=iir is not supported by the MPI engine\n";
+        MPI_Finalize();
+        return 1;
+    }
+    if (gaussian_impl != "separable" && gaussian_impl != "direct") {
+        if (rank == 0) std::cerr << "Unknown gaussian implementation: " << gaussian_impl << "\n";
+        MPI_Finalize();
+        return 1;
+    }
+    bool separable_gaussian = (gaussian_impl == "separable");
+
+    // "rows" is the name from before images were split into 2D blocks.
+    std::string distribute = opts.get("distribute", "blocks");
+    if (distribute == "rows") distribute = "blocks";
+    if (distribute != "blocks" && distribute != "images") {
+        if (rank == 0) std::cerr << "Unknown distribution: " << distribute << " (expected blocks or images)\n";
+        MPI_Finalize();
+        return 1;
+    }
+
+    Codec codec;
+    if (!parse_codec(opts.get("codec", "root"), codec)) {
+        if (rank == 0) std::cerr << "Unknown codec placement: " << opts.get("codec", "") << " (expected root or ranks)\n";
+        MPI_Finalize();
+        return 1;
+    }
+
+    // Block sizes: even, or in proportion to each rank's measured speed.
+    const std::string balance = opts.get("balance", "even");
+    if (balance != "even" && balance != "speed") {
+        if (rank == 0) std::cerr << "Unknown balance: " << balance << " (expected even or speed)\n";
+        MPI_Finalize();
+        return 1;
+    }
+    const std::string speed_profile = opts.get("speed-profile", "");
+
+    if (!set_simd_level(opts.get("simd", "auto"))) {
+        if (rank == 0) std::cerr << "Unknown SIMD level: " << opts.get("simd", "") << "\n";
+        MPI_Finalize();
+        return 1;
+    }
+
+    SobelNorm sobel_norm;
+    if (!parse_sobel_norm(opts.get("sobel-norm", "l2"), sobel_norm)) {
+        if (rank == 0) std::cerr << "Unknown Sobel norm: " << opts.get("sobel-norm", "") << "\n";
+        MPI_Finalize();
+        return 1;
+    }
+
+    BorderMode border;
+    if (!parse_border_mode(opts.get("border", "clamp"), border)) {
+        if (rank == 0) std::cerr << "Unknown border mode: " << opts.get("border", "") << "\n";
+        MPI_Finalize();
+        return 1;
+    }
+
+    GaussianKernel gaussian;
+    int box_radius = 4, box_passes = 1, writers = 0;
+    try {
+        if (operation == "gaussian") gaussian = gaussian_kernel_from_options(opts, 4);
+        if (operation == "box") box_radius = opts.get_int("radius", 4);
+        box_passes = opts.get_int("box-passes", 1);
+        writers = opts.get_int("writer-ranks", 0);
+    }
+    catch (const std::exception& e) {
+        if (rank == 0) std::cerr << e.what() << "\n";
+        MPI_Finalize();
+        return 1;
+    }
+    if (operation == "box" && (box_radius < 0 || box_radius > MAX_BOX_RADIUS)) {
+        if (rank == 0) std::cerr << "--radius must be between 0 and " << MAX_BOX_RADIUS << " for box\n";
+        MPI_Finalize();
+        return 1;
+    }
+    if (box_passes < 1) {
+        if (rank == 0) std::cerr << "--box-passes must be at least 1\n";
+        MPI_Finalize();
+        return 1;
+    }
+    if (operation != "grayscale" && operation != "gaussian" && operation != "sobel" && operation != "box") {
+        if (rank == 0) std::cerr << "Unknown operation: " << operation << "\n";
+        MPI_Finalize();
+        return 1;
+    }
+
+    if (writers < 0 || writers >= size) {
+        if (rank == 0) std::cerr << "--writer-ranks must leave at least one of the " << size << " ranks to compute\n";
+        MPI_Finalize();
+        return 1;
+    }
+    if (writers > 0 && (distribute != "blocks" || codec != Codec::Root)) {
+        if (rank == 0) std::cerr << "--writer-ranks needs --distribute=blocks and --codec=root\n";
+        MPI_Finalize();
+        return 1;
+    }
+    const std::string transport = opts.get("transport", "messages");
+    if (transport != "messages" && transport != "shared") {
+        if (rank == 0) std::cerr << "Unknown transport: " << transport << " (expected messages or shared)\n";
+        MPI_Finalize();
+        return 1;
+    }
+    const bool shared = transport == "shared";
+    MPI_Comm node = MPI_COMM_NULL;
+    if (shared) {
+        MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &node);
+        int local = 0;
+        MPI_Comm_size(node, &local);
+        const char* error = nullptr;
+        if (local != size) error = "--transport=shared needs every rank on one node";
+        else if (distribute != "blocks" || codec != Codec::Root || writers > 0)
+            error = "--transport=shared needs --distribute=blocks and --codec=root, without --writer-ranks";
+        if (error) {
+            if (rank == 0) std::cerr << error << "\n";
+            MPI_Comm_free(&node);
+            MPI_Finalize();
+            return 1;
+        }
+    }
+
+    // Rank 0's decode and export threads when it pipelines the blocks distribution:
+    // by default one decodes the next image and one encodes the last while the
+    // ranks work on the current one.
+    PipelineLimits limits;
+    try { limits = pipeline_limits_from_options(opts, 2, 3); }
+    catch (const std::exception& e) {
+        if (rank == 0) std::cerr << e.what() << "\n";
+        MPI_Finalize();
+        return 1;
+    }
+
   
-    std::vector<std::string> images;
+    std::vector<ManifestEntry> files;
     if (rank == 0) {
+        int threads = 1;
+#ifdef _OPENMP
+        threads = omp_get_max_threads();
+#endif
         std::cout << "Performing '" << operation << "' on images in " << input_dir
-                  << " using " << size << " MPI ranks.\n";
+                  << " using " << size - writers << " MPI ranks x " << threads << " threads";
+        if (writers > 0) std::cout << " and " << writers << " writer rank(s)";
+        std::cout << ".\n";
+        std::vector<std::string> images;
         if (fs::is_directory(input_dir)) {
             for (auto &entry : fs::directory_iterator(input_dir)) {
                 std::string ext = entry.path().extension().string();
@@ -411,78 +1342,405 @@ int main(int argc, char** argv) {
             images.push_back(input_dir);
         }
         std::sort(images.begin(), images.end());
-        std::cout << "Found " << images.size() << " image(s).\n";
+        for (const std::string& path : images) files.push_back(probe_file(path));
+        // Largest first (LPT), probed from the file headers without decoding, so the
+        // biggest images never trail the batch. Unreadable files sort last and fail
+        // when they are loaded; the report stays in name order.
+        std::stable_sort(files.begin(), files.end(), [](const ManifestEntry& a, const ManifestEntry& b) {
+            return (size_t)a.width * a.height > (size_t)b.width * b.height;
+        });
+        std::cout << "Found " << files.size() << " image(s).\n";
+    }
+    if (!broadcast_manifest(files, rank)) {
+        if (rank == 0) std::cerr << "The file list is too long to broadcast; split the batch into smaller folders\n";
+        MPI_Finalize();
+        return 1;
+    }
+    const int image_count = files.size();
+    // --codec=ranks broadcasts each file in one MPI_Bcast and decodes it from memory,
+    // both with an int length.
+    if (codec == Codec::Ranks) {
+        for (const ManifestEntry& f : files) {
+            if (f.bytes <= INT_MAX) continue;
+            if (rank == 0)
+                std::cerr << f.path << " is " << f.bytes << " bytes, over the 2 GiB --codec=ranks can broadcast;"
+                          << " use --codec=root\n";
+            MPI_Finalize();
+            return 1;
+        }
     }
 
-    
-    int image_count = images.size();
-    MPI_Bcast(&image_count, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    const int out_channels = (operation == "grayscale" || operation == "sobel") ? 1 : 3;
+    // Halo of the operation's blocks. A radius deeper than the image is thin leaves
+    // fewer ranks with blocks of their own; the others sit the image out.
+    int halo = 0;
+    if (operation == "sobel") halo = 1;
+    else if (operation == "gaussian") halo = gaussian.radius;
+    else if (operation == "box") halo = box_radius;
 
-    if (rank != 0) {
-        images.resize(image_count);
-    }
+    auto output_path = [&](const std::string& infile) {
+        return output_dir + "/" + fs::path(infile).stem().string() + "_" + operation + ".png";
+    };
+    auto pixels = [&](size_t i) { return (size_t)files[i].width * files[i].height; };
+
+    // With --balance=speed, each rank's speed at the operation in pixels per ms,
+    // indexed by rank in MPI_COMM_WORLD; the ranks of the blocks' communicators keep
+    // their world ranks, so it indexes those too. Empty for even blocks.
+    std::vector<double> speed;
+    const std::vector<double> no_speed;
+
+    // Runs the operation on the decoded image across the n ranks of comm; grid is
+    // left for the caller to free.
+    auto compute = [&](unsigned char* img, int width, int height, MPI_Comm comm, int n, BlockGrid& grid) {
+        grid = make_grid(comm, n, width, height, halo, border, comm == MPI_COMM_SELF ? no_speed : speed);
+        if (grid.cart == MPI_COMM_NULL) { stbi_image_free(img); return BlockResult(); }
+        if (operation == "grayscale") return mpi_grayscale(img, grid, codec);
+        if (operation == "gaussian") return mpi_gaussian(img, grid, codec, separable_gaussian, gaussian, border);
+        if (operation == "sobel") return mpi_sobel(img, grid, codec, sobel_norm, border);
+        return mpi_box(img, grid, codec, box_radius, box_passes, border);
+    };
 
-   
-    for (int i = 0; i < image_count; ++i) {
-        int path_len = 0;
-        if (rank == 0) {
-            path_len = images[i].length();
+    // Runs one image across the ranks of comm; rank and size are within comm.
+    auto run_image = [&](const ManifestEntry& file, MPI_Comm comm, int r, int n) {
+        ImageTiming timing = {fs::path(file.path).filename().string(), 0.0, 0.0, 0.0};
+        int width = 0, height = 0;
+        double t0 = MPI_Wtime();
+        unsigned char* img = load_rgb(file, comm, r, codec, width, height);
+        double t1 = MPI_Wtime();
+        BlockGrid grid;
+        BlockResult res = compute(img, width, height, comm, n, grid);
+        OutputRows out;
+        if (grid.cart != MPI_COMM_NULL) out = collect_rows(res.tile.data(), res.halo, out_channels, grid, codec);
+        double t2 = MPI_Wtime();
+        if (grid.cart != MPI_COMM_NULL) {
+            write_rows(out, out_channels, grid, codec, output_path(file.path));
+            free_grid(grid);
         }
-        MPI_Bcast(&path_len, 1, MPI_INT, 0, MPI_COMM_WORLD);
+        double t3 = MPI_Wtime();
+        timing.load_ms = (t1 - t0) * 1000.0;
+        timing.process_ms = (t2 - t1) * 1000.0;
+        timing.export_ms = (t3 - t2) * 1000.0;
+        return timing;
+    };
 
-        char* path_buf = new char[path_len + 1];
+    if (balance == "speed" && distribute == "blocks" && size > 1) {
+        // Every rank's speed comes from the profile when it has every host; if not,
+        // all ranks time the operation on a synthetic image at the same time, so an
+        // oversubscribed host shows its contention, and the profile takes each host's
+        // mean. Ranks on one host share its entry.
+        char host[MPI_MAX_PROCESSOR_NAME] = {};
+        int host_len = 0;
+        MPI_Get_processor_name(host, &host_len);
+        std::vector<char> hosts(rank == 0 ? (size_t)size * MPI_MAX_PROCESSOR_NAME : 0);
+        MPI_Gather(host, MPI_MAX_PROCESSOR_NAME, MPI_CHAR, hosts.data(), MPI_MAX_PROCESSOR_NAME, MPI_CHAR, 0,
+                   MPI_COMM_WORLD);
+        speed.assign(size, 0.0);
+        std::vector<std::string> keys(size);
+        std::map<std::string, double> profile;
+        int calibrate = 0;
+        if (rank == 0) {
+            std::map<std::string, int> ranks_on;
+            for (int q = 0; q < size; ++q) ++ranks_on[&hosts[(size_t)q * MPI_MAX_PROCESSOR_NAME]];
+            for (int q = 0; q < size; ++q) {
+                const std::string name = &hosts[(size_t)q * MPI_MAX_PROCESSOR_NAME];
+                keys[q] = name + " " + operation + " " + std::to_string(ranks_on[name]);
+            }
+            if (!speed_profile.empty()) profile = read_speed_profile(speed_profile);
+            for (int q = 0; q < size; ++q) {
+                auto it = profile.find(keys[q]);
+                if (it == profile.end() || !(it->second > 0)) calibrate = 1;
+                else speed[q] = it->second;
+            }
+        }
+        MPI_Bcast(&calibrate, 1, MPI_INT, 0, MPI_COMM_WORLD);
+        if (calibrate) {
+            const int side = 512, runs = 3;
+            double seconds = 0.0;
+            for (int k = 0; k <= runs; ++k) {
+                // compute frees the image as stbi_image_free does.
+                unsigned char* img = (unsigned char*)std::malloc((size_t)side * side * 3);
+                for (size_t p = 0; p < (size_t)side * side * 3; ++p) img[p] = (unsigned char)((p * 2654435761u) >> 24);
+                BlockGrid grid;
+                const double t0 = MPI_Wtime();
+                compute(img, side, side, MPI_COMM_SELF, 1, grid);
+                if (k > 0) seconds += MPI_Wtime() - t0;  // the first run warms up
+                free_grid(grid);
+            }
+            const double mine = runs * (double)side * side / std::max(seconds * 1000.0, 1e-9);
+            MPI_Gather(&mine, 1, MPI_DOUBLE, speed.data(), 1, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+            if (rank == 0) {
+                std::map<std::string, std::pair<double, int>> sums;
+                for (int q = 0; q < size; ++q) {
+                    sums[keys[q]].first += speed[q];
+                    ++sums[keys[q]].second;
+                }
+                for (const auto& [key, sum] : sums) profile[key] = sum.first / sum.second;
+                for (int q = 0; q < size; ++q) speed[q] = profile[keys[q]];
+                if (!speed_profile.empty() && !write_speed_profile(speed_profile, profile))
+                    std::cerr << "Could not write the speed profile to " << speed_profile << "\n";
+            }
+        }
+        MPI_Bcast(speed.data(), size, MPI_DOUBLE, 0, MPI_COMM_WORLD);
         if (rank == 0) {
-            strcpy(path_buf, images[i].c_str());
+            std::cout << "Rank speeds (pixels/ms" << (calibrate ? ", calibrated" : ", from " + speed_profile) << "):";
+            for (double v : speed) std::cout << " " << std::llround(v);
+            std::cout << "\n";
         }
-        MPI_Bcast(path_buf, path_len, MPI_CHAR, 0, MPI_COMM_WORLD);
-        path_buf[path_len] = '\0';
-        images[i] = std::string(path_buf);
-        delete[] path_buf;
     }
 
-
     std::vector<ImageTiming> timings;
     double total_load = 0.0, total_process = 0.0, total_export = 0.0;
-
-   
-    for (auto &infile : images) {
-        if(rank == 0) {
-             std::cout << "Processing " << infile << "...\n";
+    double export_wall = -1.0;  // set when exports overlap the compute
+
+    if (distribute == "images") {
+        // Whole images, handed out one at a time: a rank asks rank 0 for the next
+        // index whenever it is free, so ranks that draw small images simply come
+        // back sooner. With other ranks to serve, rank 0 only dispatches.
+        enum { TAG_REQUEST = 1, TAG_ASSIGN = 2 };
+        std::vector<double> mine;  // index, load, process, export for each image this rank ran
+
+        auto run_local = [&](int i) {
+            std::cout << "Processing " << files[i].path << " on rank " << rank << "...\n";
+            ImageTiming t = run_image(files[i], MPI_COMM_SELF, 0, 1);
+            mine.insert(mine.end(), {(double)i, t.load_ms, t.process_ms, t.export_ms});
+        };
+
+        if (size == 1) {
+            for (int i = 0; i < image_count; ++i) run_local(i);
+        }
+        else if (rank == 0) {
+            int next = 0;
+            for (int stopped = 0; stopped < size - 1;) {
+                MPI_Status st;
+                MPI_Recv(nullptr, 0, MPI_INT, MPI_ANY_SOURCE, TAG_REQUEST, MPI_COMM_WORLD, &st);
+                int assign = next < image_count ? next++ : -1;
+                if (assign < 0) ++stopped;
+                MPI_Send(&assign, 1, MPI_INT, st.MPI_SOURCE, TAG_ASSIGN, MPI_COMM_WORLD);
+            }
         }
-        std::string fname = fs::path(infile).filename().string();
-        std::string outpath = output_dir + "/" + fs::path(infile).stem().string();
-
-        ImageTiming timing = {fname, 0.0, 0.0, 0.0};
-
-        if (operation == "grayscale")
-            mpi_grayscale(infile, outpath + "_grayscale.png", rank, size, timing);
-        else if (operation == "gaussian")
-            mpi_gaussian(infile, outpath + "_gaussian.png", rank, size, timing);
-        else if (operation == "sobel")
-            mpi_sobel(infile, outpath + "_sobel.png", rank, size, timing);
         else {
-            if (rank == 0) std::cerr << "Unknown operation: " << operation << "\n";
-            MPI_Abort(MPI_COMM_WORLD, 1);
+            for (;;) {
+                int i = -1;
+                MPI_Send(nullptr, 0, MPI_INT, 0, TAG_REQUEST, MPI_COMM_WORLD);
+                MPI_Recv(&i, 1, MPI_INT, 0, TAG_ASSIGN, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+                if (i < 0) break;
+                run_local(i);
+            }
         }
 
+        // Timings come back once, at the end, instead of a collective per image.
+        int count = mine.size();
+        std::vector<int> counts(size), displs(size);
+        MPI_Gather(&count, 1, MPI_INT, counts.data(), 1, MPI_INT, 0, MPI_COMM_WORLD);
+        std::vector<double> all;
+        if (rank == 0) {
+            std::partial_sum(counts.begin(), counts.end() - 1, displs.begin() + 1);
+            all.resize(displs[size - 1] + counts[size - 1]);
+        }
+        MPI_Gatherv(mine.data(), count, MPI_DOUBLE, all.data(), counts.data(), displs.data(), MPI_DOUBLE,
+                    0, MPI_COMM_WORLD);
+        for (size_t k = 0; k + 3 < all.size(); k += 4) {
+            ImageTiming t = {fs::path(files[(int)all[k]].path).filename().string(), all[k + 1], all[k + 2], all[k + 3]};
+            timings.push_back(t);
+            total_load += t.load_ms;
+            total_process += t.process_ms;
+            total_export += t.export_ms;
+        }
+    }
+    else if (codec == Codec::Root) {
+        // Pipelined on rank 0: its --io-threads pool decodes upcoming images and
+        // encodes finished ones while its main thread, the only one that calls MPI,
+        // takes the current image through the blocks with the other ranks. Those
+        // follow in the same order and go straight from one image to the next.
+        // With --writer-ranks, the last ranks only encode: image i goes to writer
+        // i % writers, which receives its blocks while the ranks that computed them
+        // move on, and rank 0 keeps only the decoding. Image sizes all come from the
+        // manifest, so nothing but the blocks themselves is sent per image.
+        enum { TAG_BLOCK = 4 };
+        const int workers = size - writers;
+        MPI_Comm work = MPI_COMM_WORLD;
+        if (writers > 0) MPI_Comm_split(MPI_COMM_WORLD, rank >= workers, rank, &work);
+        auto writer_of = [&](int i) { return workers + i % writers; };
+
+        // Block sends to the writers still in flight, with the tiles they read from.
+        std::deque<std::pair<MPI_Request, BlockResult>> sending;
+        auto finish_sends = [&](size_t keep) {
+            for (; sending.size() > keep; sending.pop_front())
+                MPI_Wait(&sending.front().first, MPI_STATUS_IGNORE);
+        };
+        // The rest of an image after compute: its block goes to its writer, or is
+        // gathered to rank 0 for its export threads.
+        auto hand_off = [&](int i, BlockResult res, const BlockGrid& grid) {
+            if (grid.cart == MPI_COMM_NULL) return OutputRows();
+            if (writers == 0) return collect_rows(res.tile.data(), res.halo, out_channels, grid, Codec::Root);
+            MPI_Request req = send_block(res.tile.data(), res.halo, out_channels, grid, writer_of(i), TAG_BLOCK);
+            sending.emplace_back(req, std::move(res));
+            finish_sends(limits.max_inflight);
+            return OutputRows();
+        };
+        std::vector<double> written;  // index and export time of each image a writer rank encoded
+
+        SharedImages shm;
+        if (shared) {
+            size_t max_pixels = 0;
+            for (int i = 0; i < image_count; ++i) max_pixels = std::max(max_pixels, pixels(i));
+            shm = make_shared_images(node, max_pixels, operation == "sobel", operation == "box");
+        }
+        // Runs the image rank 0 has put in shm.in over every rank's rows and returns
+        // the window with the result.
+        auto run_shared = [&](int width, int height) {
+            shared_sync(shm);
+            std::vector<int> rows;
+            split_weighted(height, size, speed.empty() ? nullptr : speed.data(), 1, rows);
+            const int y0 = rows[rank], y1 = rows[rank + 1];
+            const unsigned char* res = nullptr;
+            dispatch_border(border, [&](auto policy) {
+                using Border = decltype(policy);
+                if (operation == "grayscale") res = shared_grayscale(shm, width, y0, y1);
+                else if (operation == "sobel") res = shared_sobel<Border>(shm, width, height, y0, y1, sobel_norm);
+                else if (operation == "gaussian")
+                    res = shared_gaussian<Border>(shm, width, height, y0, y1, separable_gaussian, gaussian);
+                else res = shared_box<Border>(shm, width, height, y0, y1, box_radius, box_passes);
+            });
+            shared_sync(shm);
+            return res;
+        };
 
         if (rank == 0) {
-            timings.push_back(timing);
-            total_load += timing.load_ms;
-            total_process += timing.process_ms;
-            total_export += timing.export_ms;
+            struct Slot {
+                unsigned char* img = nullptr;
+                int dims[2] = {0, 0};  // width, height as decoded
+                OutputRows out;
+                ImageTiming timing;
+            };
+            std::vector<Slot> slots(image_count);
+            auto bytes = [&](size_t i) { return pixels(i) * (3 + out_channels); };
+            // load and save run on the --io-threads pool, so they time themselves with
+            // steady_clock: under MPI_THREAD_FUNNELED only process may call MPI.
+            using Clock = std::chrono::steady_clock;
+            auto load = [&](size_t i) {
+                Slot& s = slots[i];
+                s.timing.image_name = fs::path(files[i].path).filename().string();
+                auto t0 = Clock::now();
+                int c;
+                s.img = stbi_load(files[i].path.c_str(), &s.dims[0], &s.dims[1], &c, 3);
+                s.timing.load_ms = std::chrono::duration<double, std::milli>(Clock::now() - t0).count();
+                return true;  // the other ranks expect every image; process aborts on failures
+            };
+            auto process = [&](size_t i) {
+                Slot& s = slots[i];
+                const ManifestEntry& f = files[i];
+                // The other ranks already run on the manifest's size.
+                if (!s.img || s.dims[0] != f.width || s.dims[1] != f.height) {
+                    std::cerr << "Failed to load " << f.path << "\n";
+                    MPI_Abort(MPI_COMM_WORLD, 1);
+                }
+                std::cout << "Processing " << f.path << "...\n";
+                double t0 = MPI_Wtime();
+                if (shared) {
+                    // The window is free again: every rank has finished the last image.
+                    const size_t n = pixels(i);
+                    std::copy(s.img, s.img + n * 3, shm.in);
+                    stbi_image_free(s.img);
+                    const unsigned char* res = run_shared(f.width, f.height);
+                    s.out.pixels.assign(res, res + n * out_channels);
+                }
+                else {
+                    BlockGrid grid;
+                    BlockResult res = compute(s.img, f.width, f.height, work, workers, grid);
+                    s.out = hand_off(i, std::move(res), grid);
+                    free_grid(grid);
+                }
+                s.timing.process_ms = (MPI_Wtime() - t0) * 1000.0;
+            };
+            auto save = [&](size_t i) {
+                Slot& s = slots[i];
+                if (writers > 0) return;
+                auto t0 = Clock::now();
+                stbi_write_png(output_path(files[i].path).c_str(), s.dims[0], s.dims[1], out_channels,
+                               s.out.pixels.data(), s.dims[0] * out_channels);
+                s.timing.export_ms = std::chrono::duration<double, std::milli>(Clock::now() - t0).count();
+                s.out = OutputRows();
+            };
+            PipelineStats stats = run_pipeline(image_count, limits, bytes, load, process, save);
+            if (writers == 0) export_wall = stats.export_wall_ms;
+            finish_sends(0);
+            for (const Slot& s : slots) timings.push_back(s.timing);
+        }
+        else if (rank < workers) {
+            for (int i = 0; i < image_count; ++i) {
+                if (shared) { run_shared(files[i].width, files[i].height); continue; }
+                BlockGrid grid;
+                BlockResult res = compute(nullptr, files[i].width, files[i].height, work, workers, grid);
+                hand_off(i, std::move(res), grid);
+                free_grid(grid);
+            }
+            finish_sends(0);
+        }
+        else {
+            for (int i = rank - workers; i < image_count; i += writers) {
+                const ManifestEntry& f = files[i];
+                std::vector<unsigned char> full(pixels(i) * out_channels);
+                receive_blocks(full.data(), f.width, f.height, out_channels, workers, halo, speed, TAG_BLOCK);
+                double t0 = MPI_Wtime();
+                stbi_write_png(output_path(f.path).c_str(), f.width, f.height, out_channels, full.data(),
+                               f.width * out_channels);
+                written.insert(written.end(), {(double)i, (MPI_Wtime() - t0) * 1000.0});
+            }
         }
 
-        MPI_Barrier(MPI_COMM_WORLD); 
+        if (writers > 0) {
+            // Export times come back from the writers once, at the end.
+            int count = written.size();
+            std::vector<int> counts(size), displs(size);
+            MPI_Gather(&count, 1, MPI_INT, counts.data(), 1, MPI_INT, 0, MPI_COMM_WORLD);
+            std::vector<double> all;
+            if (rank == 0) {
+                std::partial_sum(counts.begin(), counts.end() - 1, displs.begin() + 1);
+                all.resize(displs[size - 1] + counts[size - 1]);
+            }
+            MPI_Gatherv(written.data(), count, MPI_DOUBLE, all.data(), counts.data(), displs.data(), MPI_DOUBLE,
+                        0, MPI_COMM_WORLD);
+            for (size_t k = 0; k + 1 < all.size(); k += 2) timings[(int)all[k]].export_ms = all[k + 1];
+            MPI_Comm_free(&work);
+        }
+        if (shared) {
+            free_shared_images(shm);
+            MPI_Comm_free(&node);
+        }
+        for (const ImageTiming& t : timings) {
+            total_load += t.load_ms;
+            total_process += t.process_ms;
+            total_export += t.export_ms;
+        }
+    }
+    else {
+        for (const ManifestEntry& file : files) {
+            if(rank == 0) {
+                 std::cout << "Processing " << file.path << "...\n";
+            }
+
+            ImageTiming timing = run_image(file, MPI_COMM_WORLD, rank, size);
+
+            if (rank == 0) {
+                timings.push_back(timing);
+                total_load += timing.load_ms;
+                total_process += timing.process_ms;
+                total_export += timing.export_ms;
+            }
+        }
     }
 
     if (rank == 0) {
+        std::sort(timings.begin(), timings.end(),
+                  [](const ImageTiming& a, const ImageTiming& b) { return a.image_name < b.image_name; });
         std::ofstream jf(output_dir + "/timings.json");
         jf << std::fixed << std::setprecision(4);
         jf << "{\n";
         jf << "  \"total_loading_time\": " << total_load << ",\n";
         jf << "  \"total_processing_time\": " << total_process << ",\n";
         jf << "  \"total_exporting_time\": " << total_export << ",\n";
+        if (export_wall >= 0.0) jf << "  \"total_exporting_wall_time\": " << export_wall << ",\n";
         jf << "  \"individual_image_times\": [\n";
 
         for (size_t i = 0; i < timings.size(); ++i) {
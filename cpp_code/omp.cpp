@@ -9,8 +9,10 @@
 #include <cmath>
 #include <algorithm>
 #include <omp.h>
+#include <unistd.h>
 #include <iomanip> 
 #include <fstream>
+#include <memory>
 
 // STB Image libraries
 #define STB_IMAGE_IMPLEMENTATION
@@ -18,15 +20,25 @@
 #include "stb_image.h"
 #include "stb_image_write.h"
 
+#include "options.h"
+#include "filters.h"
+#include "gaussian.h"
+#include "simd.h"
+#include "convolve.h"
+#include "pipeline.h"
+#include "scheduler.h"
+
 namespace fs = std::filesystem;
 
 
 struct Image {
-    std::string name, ext;
-    int width, height, channels_in;
-    int channels_out;
-    unsigned char* input_host;
-    unsigned char* output_host;
+    std::string path, name, ext;
+    int width = 0, height = 0, channels_in = 0;
+    int channels_out = 0;
+    size_t pixels = 0;  // width * height from the header probe, 0 if unreadable
+    size_t listed = 0;  // position in the directory listing
+    unsigned char* input_host = nullptr;
+    unsigned char* output_host = nullptr;
 
     float time_load_ms = 0.0f;
     float time_process_ms = 0.0f;
@@ -45,93 +57,246 @@ struct Image {
 };
 
 
-// (Paste your 27x27 GAUSSIAN_27x27 and 3x3 sobel kernels here)
-const float GAUSSIAN_9x9[81] = {
-    1.16788635e-02f, 1.19232554e-02f, 1.21009460e-02f, 1.22088289e-02f, 1.22450031e-02f, 1.22088289e-02f, 1.21009460e-02f, 1.19232554e-02f, 1.16788635e-02f,
-    1.19232554e-02f, 1.21727614e-02f, 1.23541704e-02f, 1.24643108e-02f, 1.25012421e-02f, 1.24643108e-02f, 1.23541704e-02f, 1.21727614e-02f, 1.19232554e-02f,
-    1.21009460e-02f, 1.23541704e-02f, 1.25382828e-02f, 1.26500647e-02f, 1.26875463e-02f, 1.26500647e-02f, 1.25382828e-02f, 1.23541704e-02f, 1.21009460e-02f,
-    1.22088289e-02f, 1.24643108e-02f, 1.26500647e-02f, 1.27628431e-02f, 1.28006589e-02f, 1.27628431e-02f, 1.26500647e-02f, 1.24643108e-02f, 1.22088289e-02f,
-    1.22450031e-02f, 1.25012421e-02f, 1.26875463e-02f, 1.28006589e-02f, 1.28385867e-02f, 1.28006589e-02f, 1.26875463e-02f, 1.25012421e-02f, 1.22450031e-02f,
-    1.22088289e-02f, 1.24643108e-02f, 1.26500647e-02f, 1.27628431e-02f, 1.28006589e-02f, 1.27628431e-02f, 1.26500647e-02f, 1.24643108e-02f, 1.22088289e-02f,
-    1.21009460e-02f, 1.23541704e-02f, 1.25382828e-02f, 1.26500647e-02f, 1.26875463e-02f, 1.26500647e-02f, 1.25382828e-02f, 1.23541704e-02f, 1.21009460e-02f,
-    1.19232554e-02f, 1.21727614e-02f, 1.23541704e-02f, 1.24643108e-02f, 1.25012421e-02f, 1.24643108e-02f, 1.23541704e-02f, 1.21727614e-02f, 1.19232554e-02f,
-    1.16788635e-02f, 1.19232554e-02f, 1.21009460e-02f, 1.22088289e-02f, 1.22450031e-02f, 1.22088289e-02f, 1.21009460e-02f, 1.19232554e-02f, 1.16788635e-02f
+// Buffers a scheduler worker keeps from task to task; each operation grows only
+// the ones it uses.
+struct WorkerScratch {
+    SeparableScratch separable;
+    std::vector<unsigned char> bytes;  // haloed tiles, box row lines, the Sobel ring
+    std::vector<float> floats;         // IIR lines and strips
+    std::vector<uint32_t> sums;        // box column accumulators
+    FftConvScratch fft;
 };
-const float sobel_x[9] = {-1, 0, 1, -2, 0, 2, -1, 0, 1};
-const float sobel_y[9] = {-1, -2, -1, 0, 0, 0, 1, 2, 1};
 
-inline int clamp(int val, int min_val, int max_val) {
-    return std::min(std::max(val, min_val), max_val);
+// Each operation below is written as the phases of one image's work for the
+// scheduler (scheduler.h): units within a phase are independent, and phases run in
+// order. Buffers shared by an image's tasks are held by the tasks themselves, so
+// they live until the image's last task is done. The row lambdas copy what they
+// read: captured by reference, the task's own members have to be reloaded after
+// every byte store, which cost the Gaussian about a quarter of its time.
+
+PhaseList grayscale_phases(const unsigned char* in, unsigned char* out, int w, int h, int c_in) {
+    // The frame is one contiguous run of pixels, so split it into fixed-size chunks
+    // instead of rows; narrow images still give every task full vectors.
+    const size_t n = (size_t)w * h;
+    const size_t chunk = 1 << 16;
+    const int chunks = (int)((n + chunk - 1) / chunk);
+    return {{chunks, chunk, [=](int u0, int u1, int) {
+        const size_t first = (size_t)u0 * chunk, last = std::min((size_t)u1 * chunk, n);
+        // The vector kernel reads packed RGB; any other channel stride takes the per-pixel loop.
+        if (c_in == 3) {
+            rgb_to_gray_row(in + first * 3, out + first, last - first);
+            return;
+        }
+        for (size_t i = first; i < last; ++i) {
+            const unsigned char* p = in + i * c_in;
+            float r = p[0], g = p[1], b = p[2];
+            out[i] = static_cast<unsigned char>(0.299f * r + 0.587f * g + 0.114f * b);
+        }
+    }}};
 }
-inline float clamp_f(float val, float min_val, float max_val) {
-    return std::min(std::max(val, min_val), max_val);
+
+template <class Border>
+PhaseList gaussian_phases(const unsigned char* in, unsigned char* out, int w, int h, int c_in,
+                          const float* kernel, int k_size) {
+    const size_t stride = (size_t)w * c_in;
+    auto zero_row = std::make_shared<std::vector<unsigned char>>(stride, 0);
+    return {{h, (size_t)w, [=](int y0, int y1, int) {
+        auto row = [=, zero = zero_row->data()](int y) { return border_row<Border>(in, stride, h, y, zero); };
+        gaussian_direct_rows<Border>(row, out + y0 * stride, w, c_in, y0, y1, kernel, k_size, false);
+    }}};
 }
 
-void apply_grayscale(const unsigned char* in, unsigned char* out, int w, int h, int c_in) {
-    #pragma omp parallel for
-    for (int y = 0; y < h; ++y) {
-        for (int x = 0; x < w; ++x) {
-            int idx_in = (y * w + x) * c_in;
-            int idx_out = y * w + x;
-            float r = in[idx_in], g = in[idx_in + 1], b = in[idx_in + 2];
-            out[idx_out] = static_cast<unsigned char>(0.299f * r + 0.587f * g + 0.114f * b);
-        }
-    }
+template <class Border>
+PhaseList gaussian_separable_phases(const unsigned char* in, unsigned char* out, int w, int h, int c_in,
+                                    const float* kernel_1d, int k_size, std::vector<WorkerScratch>& scratch) {
+    const size_t stride = (size_t)w * c_in;
+    auto zero_row = std::make_shared<std::vector<unsigned char>>(stride, 0);
+    PhaseList phases;
+    dispatch_radius(k_size / 2, [&](auto radius) {
+        phases.push_back({h, (size_t)w, [=, &scratch](int y0, int y1, int worker) {
+            auto row = [=, zero = zero_row->data()](int y) { return border_row<Border>(in, stride, h, y, zero); };
+            gaussian_separable_rows<radius.value, Border>(row, out + y0 * stride, w, c_in, y0, y1,
+                                                          kernel_1d, k_size, false, scratch[worker].separable);
+        }});
+    });
+    return phases;
 }
 
-void apply_gaussian(const unsigned char* in, unsigned char* out, int w, int h, int c_in,
-                    const float* kernel, int k_size) {
-    int half = k_size / 2;
-    #pragma omp parallel for
-    for (int y = 0; y < h; ++y) {
-        for (int x = 0; x < w; ++x) {
-            float r_sum = 0.0f, g_sum = 0.0f, b_sum = 0.0f;
-            for (int ky = -half; ky <= half; ++ky) {
-                for (int kx = -half; kx <= half; ++kx) {
-                    int nx = clamp(x + kx, 0, w - 1);
-                    int ny = clamp(y + ky, 0, h - 1);
-                    int nIdx = (ny * w + nx) * c_in;
-                    float k_val = kernel[(ky + half) * k_size + (kx + half)];
-                    r_sum += k_val * in[nIdx];
-                    g_sum += k_val * in[nIdx + 1];
-                    b_sum += k_val * in[nIdx + 2];
-                }
+// Rows are independent in the horizontal pass and column strips in the vertical
+// one, so each pass is one phase.
+template <class Border>
+PhaseList gaussian_iir_phases(const unsigned char* in, unsigned char* out, int w, int h, int c_in, float sigma,
+                              std::vector<WorkerScratch>& scratch) {
+    const IirCoefficients k = iir_coefficients(sigma);
+    const int pad = iir_padding(sigma);
+    const int strips = (w + IIR_STRIP_WIDTH - 1) / IIR_STRIP_WIDTH;
+    auto tmp = std::make_shared<std::vector<float>>((size_t)w * h * c_in);
+    return {
+        {h, (size_t)w, [=, &scratch](int y0, int y1, int worker) {
+            iir_gaussian_rows<Border>(in, tmp->data(), w, c_in, y0, y1, k, pad, scratch[worker].floats);
+        }},
+        {strips, (size_t)IIR_STRIP_WIDTH * h, [=, &scratch](int s0, int s1, int worker) {
+            for (int s = s0; s < s1; ++s) {
+                const int x0 = s * IIR_STRIP_WIDTH;
+                iir_gaussian_columns<Border>(tmp->data(), out, w, h, c_in, x0, std::min(x0 + IIR_STRIP_WIDTH, w),
+                                             k, pad, false, scratch[worker].floats);
             }
-            int outIdx = (y * w + x) * c_in;
-            out[outIdx]     = static_cast<unsigned char>(clamp_f(r_sum, 0.0f, 255.0f));
-            out[outIdx + 1] = static_cast<unsigned char>(clamp_f(g_sum, 0.0f, 255.0f));
-            out[outIdx + 2] = static_cast<unsigned char>(clamp_f(b_sum, 0.0f, 255.0f));
-        }
-    }
+        }},
+    };
 }
 
-void apply_sobel_on_gray(const unsigned char* in_gray, unsigned char* out, int w, int h,
-                         const float* kx_kernel, const float* ky_kernel, int k_size) {
-    int half = k_size / 2;
-    #pragma omp parallel for
-    for (int y = 0; y < h; ++y) {
-        for (int x = 0; x < w; ++x) {
-            float gx = 0.0f, gy = 0.0f;
-            for (int ky = -half; ky <= half; ++ky) {
-                for (int kx = -half; kx <= half; ++kx) {
-                    int nx = clamp(x + kx, 0, w - 1);
-                    int ny = clamp(y + ky, 0, h - 1);
-
-                 
-                    int idx = ny * w + nx;
-
-                    
-                    float gray_val = (float)in_gray[idx];
-
-           
-                    gx += gray_val * kx_kernel[(ky + half) * k_size + (kx + half)];
-                    gy += gray_val * ky_kernel[(ky + half) * k_size + (kx + half)];
-                }
+// Gaussian tile shape in pixels. {0, 0} keeps the row-parallel loops above,
+// {-1, -1} means pick one per image with auto_tile.
+struct TileShape { int w, h; };
+
+bool parse_tile_shape(const std::string& s, TileShape& t) {
+    if (s == "auto") { t = {-1, -1}; return true; }
+    if (s == "off") { t = {0, 0}; return true; }
+    size_t x = s.find('x');
+    if (x == std::string::npos) return false;
+    try {
+        size_t used_w = 0, used_h = 0;
+        t.w = std::stoi(s.substr(0, x), &used_w);
+        t.h = std::stoi(s.substr(x + 1), &used_h);
+        if (used_w != x || used_h != s.size() - x - 1) return false;
+    } catch (const std::exception&) { return false; }
+    return t.w > 0 && t.h > 0;
+}
+
+// Up to 512 pixels wide and tall enough that the haloed input tile fills about
+// half of L2, then shortened until every thread has a few tiles to balance.
+TileShape auto_tile(int w, int h, int c, int radius) {
+    long l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    if (l2 <= 0) l2 = 256 * 1024;
+    TileShape t;
+    t.w = std::min(w, 512);
+    t.h = std::max((int)(l2 / 2 / ((long)(t.w + 2 * radius) * c)) - 2 * radius, 16);
+    const int tiles_x = (w + t.w - 1) / t.w;
+    const int min_tiles = 4 * omp_get_max_threads();
+    t.h = std::max(std::min({t.h, h, std::max(h * tiles_x / min_tiles, 16)}), 1);
+    return t;
+}
+
+// Gaussian over L2-sized tiles instead of whole rows. Each tile is first copied
+// with its halo (border pixels resolved by the policy) into a per-worker buffer,
+// so the K rows a tap window spans stay cache-resident however wide the image is,
+// and the filter itself runs on the buffer without any border logic.
+template <class Border>
+PhaseList gaussian_tiled_phases(const unsigned char* in, unsigned char* out, int w, int h, int c_in,
+                                const GaussianKernel& gk, bool separable, TileShape tile,
+                                std::vector<WorkerScratch>& scratch) {
+    const int R = gk.radius, K = gk.size();
+    const size_t stride = (size_t)w * c_in;
+    const int tiles_x = (w + tile.w - 1) / tile.w, tiles_y = (h + tile.h - 1) / tile.h;
+
+    PhaseList phases;
+    auto build = [&](auto radius) {
+        phases.push_back({tiles_x * tiles_y, (size_t)tile.w * tile.h, [=, &gk, &scratch](int t0, int t1, int worker) {
+            std::vector<unsigned char>& buf = scratch[worker].bytes;
+            for (int t = t0; t < t1; ++t) {
+                const int x0 = t % tiles_x * tile.w, x1 = std::min(x0 + tile.w, w);
+                const int y0 = t / tiles_x * tile.h, y1 = std::min(y0 + tile.h, h);
+                load_haloed_tile<Border>(in, w, h, c_in, x0, x1, y0, y1, R, buf);
+                const int bw = x1 - x0 + 2 * R;
+                auto row = [=, base = buf.data()](int y) { return base + (size_t)(y - y0 + R) * bw * c_in; };
+                unsigned char* dst = out + (size_t)y0 * stride + (size_t)x0 * c_in;
+                if (separable)
+                    gaussian_separable_tile<radius.value>(row, bw, c_in, R, R + x1 - x0, y0, y1, gk.w1d.data(), K,
+                                                          false, dst, stride, scratch[worker].separable);
+                else
+                    gaussian_direct_tile(row, bw, c_in, R, R + x1 - x0, y0, y1, gk.w2d.data(), K, false, dst, stride);
             }
-            float mag = std::sqrt(gx * gx + gy * gy);
-            out[y * w + x] = static_cast<unsigned char>(clamp_f(mag, 0.0f, 255.0f));
-        }
+        }});
+    };
+    if (separable) dispatch_radius(R, build);
+    else build(std::integral_constant<int, -1>{});
+    return phases;
+}
+
+// Running-sum box blur: a phase of rows for the horizontal sums, then one of
+// column strips for the vertical ones. Each extra pass blurs the previous result.
+template <class Border>
+PhaseList box_phases(const unsigned char* in, unsigned char* out, int w, int h, int c_in, int r, int passes,
+                     std::vector<WorkerScratch>& scratch) {
+    const size_t stride = (size_t)w * c_in;
+    const int strip_w = 64;
+    const int strips = (w + strip_w - 1) / strip_w;
+    auto sums = std::make_shared<std::vector<uint32_t>>(stride * h);
+    auto zero_row = std::make_shared<std::vector<uint32_t>>(stride, 0);
+    PhaseList phases;
+    for (int p = 0; p < passes; ++p) {
+        const unsigned char* src = p == 0 ? in : out;
+        phases.push_back({h, (size_t)w, [=, &scratch](int y0, int y1, int worker) {
+            box_sum_rows<Border>(src, sums->data(), w, c_in, y0, y1, r, scratch[worker].bytes);
+        }});
+        phases.push_back({strips, (size_t)strip_w * h, [=, &scratch](int s0, int s1, int worker) {
+            auto row = [=, base = sums->data(), zero = zero_row->data()](int y) {
+                return border_row<Border>(base, stride, h, y, zero);
+            };
+            for (int s = s0; s < s1; ++s) {
+                const int x0 = s * strip_w;
+                box_mean_columns(row, out, w, h, c_in, x0, std::min(x0 + strip_w, w), r, false, scratch[worker].sums);
+            }
+        }});
     }
+    return phases;
+}
+
+// Direct rows are independent; FFT tiles each write their own output block, so
+// either path is a single phase.
+template <class Border>
+PhaseList convolve_phases(const unsigned char* in, unsigned char* out, int w, int h, int c_in,
+                          const ConvKernel& kernel, bool use_fft, std::vector<WorkerScratch>& scratch) {
+    if (use_fft) {
+        auto plan = std::make_shared<const FftConvPlan>(make_fft_conv_plan(kernel, w, h));
+        const int tiles_x = (w + plan->tile_w - 1) / plan->tile_w, tiles_y = (h + plan->tile_h - 1) / plan->tile_h;
+        return {{tiles_x * tiles_y, (size_t)plan->tile_w * plan->tile_h, [=, &scratch](int t0, int t1, int worker) {
+            for (int t = t0; t < t1; ++t)
+                convolve_fft_tile<Border>(in, w, h, c_in, t % tiles_x * plan->tile_w, t / tiles_x * plan->tile_h,
+                                          *plan, false, out, scratch[worker].fft);
+        }}};
+    }
+    const size_t stride = (size_t)w * c_in;
+    auto zero_row = std::make_shared<std::vector<unsigned char>>(stride, 0);
+    return {{h, (size_t)w, [=, &kernel](int y0, int y1, int) {
+        auto row = [=, zero = zero_row->data()](int y) { return border_row<Border>(in, stride, h, y, zero); };
+        convolve_direct_rows<Border>(row, out + y0 * stride, w, c_in, y0, y1, kernel, false);
+    }}};
+}
+
+// Grayscale and Sobel in one pass. Each task walks its contiguous block of rows
+// with a ring of three gray rows (above, current, below): moving down one row
+// converts only the new bottom row, so the gray frame never exists in memory.
+template <class Border>
+PhaseList sobel_phases(const unsigned char* in, unsigned char* out, int w, int h, int c_in, SobelNorm norm,
+                       std::vector<WorkerScratch>& scratch) {
+    const size_t stride = (size_t)w * c_in;
+    return {{h, (size_t)w, [=, &scratch](int y0, int y1, int worker) {
+        // Three ring slots followed by a zero row for the constant border.
+        std::vector<unsigned char>& ring = scratch[worker].bytes;
+        ring.resize(4 * (size_t)w);
+        std::fill(ring.begin() + 3 * (size_t)w, ring.end(), 0);
+        unsigned char* slot[3] = {ring.data(), ring.data() + w, ring.data() + 2 * (size_t)w};
+        const unsigned char* zero_row = ring.data() + 3 * (size_t)w;
+
+        // Converts image row y (resolved with Border) into dst.
+        auto load = [&](int y, unsigned char* dst) -> const unsigned char* {
+            int m = (y >= 0 && y < h) ? y : Border::map(y, h);
+            if (m < 0) return zero_row;
+            rgb_to_gray_row(in + (size_t)m * stride, dst, w);
+            return dst;
+        };
+
+        const unsigned char* above = load(y0 - 1, slot[0]);
+        const unsigned char* cur = load(y0, slot[1]);
+        for (int y = y0; y < y1; ++y) {
+            const unsigned char* below = load(y + 1, slot[2]);
+            sobel_row<Border>(above, cur, below, out + (size_t)y * w, w, norm, false);
+            std::rotate(slot, slot + 1, slot + 3);
+            above = cur;
+            cur = below;
+        }
+    }}};
 }
 
 
@@ -139,8 +304,13 @@ int main(int argc, char** argv)
 {
  
     if (argc < 4) {
-        std::cerr << "Usage: ./ProjectCode_OMP <input_folder> <output_folder> <operation>\n";
-        std::cerr << "Operations: grayscale | gaussian | sobel\n";
+        std::cerr << "Usage: ./ProjectCode_OMP <input_folder> <output_folder> <operation> [options]\n";
+        std::cerr << "Operations: grayscale | gaussian | sobel | box | convolve\n";
+        std::cerr << "Options: --gaussian-impl=separable|direct|iir --radius=<px> --sigma=<px>\n";
+        std::cerr << "         --simd=auto|avx512|avx2|sse4.1|scalar --sobel-norm=l2|l1|linf\n";
+        std::cerr << "         --box-passes=<n> --kernel=<file> --conv-impl=auto|direct|fft\n";
+        std::cerr << "         --border=clamp|reflect|wrap|constant --tile=auto|off|<W>x<H>\n";
+        std::cerr << "         --max-inflight=<n> --max-memory=<MB> --io-threads=<n>\n";
         return 1;
     }
 
@@ -148,87 +318,221 @@ int main(int argc, char** argv)
     std::string output_folder = argv[2];
     std::string op = argv[3];
 
-    const int KERNEL_SIZE_GAUSSIAN = 9;
-    const int KERNEL_SIZE_SOBEL = 3;
+    Options opts;
+    try { opts = parse_options(argc, argv, 4); }
+    catch (const std::exception& e) { std::cerr << e.what() << "\n"; return 1; }
+
+    std::string gaussian_impl = opts.get("gaussian-impl", "separable");
+    if (gaussian_impl != "separable" && gaussian_impl != "direct" && gaussian_impl != "iir") {
+        std::cerr << "Unknown gaussian implementation: " << gaussian_impl << "\n";
+        return 1;
+    }
+
+    if (!set_simd_level(opts.get("simd", "auto"))) {
+        std::cerr << "Unknown SIMD level: " << opts.get("simd", "") << "\n";
+        return 1;
+    }
+
+    SobelNorm sobel_norm;
+    if (!parse_sobel_norm(opts.get("sobel-norm", "l2"), sobel_norm)) {
+        std::cerr << "Unknown Sobel norm: " << opts.get("sobel-norm", "") << "\n";
+        return 1;
+    }
+
+    BorderMode border;
+    if (!parse_border_mode(opts.get("border", "clamp"), border)) {
+        std::cerr << "Unknown border mode: " << opts.get("border", "") << "\n";
+        return 1;
+    }
+
+    TileShape tile;
+    if (!parse_tile_shape(opts.get("tile", "auto"), tile)) {
+        std::cerr << "Invalid tile shape: " << opts.get("tile", "") << " (expected auto, off or <W>x<H>)\n";
+        return 1;
+    }
+
+    // The recursive Gaussian only needs sigma; the others build a kernel of some radius.
+    GaussianKernel gaussian;
+    float sigma;
+    try {
+        sigma = gaussian_sigma_from_options(opts);
+        if (op == "gaussian" && gaussian_impl == "iir") iir_coefficients(sigma);
+        else if (op == "gaussian") gaussian = gaussian_kernel_from_options(opts, 4);
+    }
+    catch (const std::exception& e) { std::cerr << e.what() << "\n"; return 1; }
+
+    int box_radius = 4, box_passes = 1;
+    try {
+        if (op == "box") box_radius = opts.get_int("radius", 4);
+        box_passes = opts.get_int("box-passes", 1);
+    }
+    catch (const std::exception& e) { std::cerr << e.what() << "\n"; return 1; }
+    if (op == "box" && (box_radius < 0 || box_radius > MAX_BOX_RADIUS)) {
+        std::cerr << "--radius must be between 0 and " << MAX_BOX_RADIUS << " for box\n";
+        return 1;
+    }
+    if (box_passes < 1) { std::cerr << "--box-passes must be at least 1\n"; return 1; }
+
+    // auto takes the FFT path once the direct loop's K^2 taps per pixel get expensive.
+    std::string conv_impl = opts.get("conv-impl", "auto");
+    if (conv_impl != "auto" && conv_impl != "direct" && conv_impl != "fft") {
+        std::cerr << "Unknown convolution implementation: " << conv_impl << "\n";
+        return 1;
+    }
+    ConvKernel conv_kernel;
+    if (op == "convolve") {
+        if (!opts.has("kernel")) { std::cerr << "convolve needs --kernel=<file>\n"; return 1; }
+        try { conv_kernel = load_conv_kernel(opts.get("kernel", "")); }
+        catch (const std::exception& e) { std::cerr << e.what() << "\n"; return 1; }
+    }
+    const bool conv_fft = conv_impl == "fft" || (conv_impl == "auto" && conv_kernel.w * conv_kernel.h > FFT_MIN_TAPS);
+
+    // Two images in flight per thread by default, so a batch of thumbnails has
+    // enough whole-image tasks to keep every thread busy.
+    const int threads = omp_get_max_threads();
+    PipelineLimits limits;
+    try {
+        limits = pipeline_limits_from_options(opts, (int)std::max(1u, std::thread::hardware_concurrency()),
+                                              std::max(4, 2 * threads));
+    }
+    catch (const std::exception& e) { std::cerr << e.what() << "\n"; return 1; }
+
 
     int output_channels;
     if (op == "grayscale" || op == "sobel") { output_channels = 1; }
-    else if (op == "gaussian") { output_channels = 3; }
+    else if (op == "gaussian" || op == "box" || op == "convolve") { output_channels = 3; }
     else { std::cerr << "Unknown operation: " << op << "\n"; return 1; }
 
     fs::create_directories(output_folder);
 
-    std::vector<Image> images;
-
+    WorkStealingScheduler scheduler(threads);
+    std::vector<WorkerScratch> scratch(threads);
 
+    // Only names and header sizes are read up front; pixels are decoded as the
+    // pipeline admits them.
+    std::vector<Image> images;
     for (const auto& entry : fs::directory_iterator(folder)) {
         if (!entry.is_regular_file()) continue;
         Image img;
+        img.path = entry.path().string();
         img.name = entry.path().stem().string();
         img.ext = entry.path().extension().string();
+        img.listed = images.size();
+        int w = 0, h = 0, c = 0;
+        if (stbi_info(img.path.c_str(), &w, &h, &c)) img.pixels = (size_t)w * h;
+        images.push_back(img);
+    }
+    if (images.empty()) {
+        std::cerr << "No images found in " << folder << "\n";
+        return 1;
+    }
+
+    // Largest first (LPT): the big images go into the first scheduler batches, where
+    // their tiles share the team with whatever else is loaded, instead of arriving
+    // last and running with nothing to balance against. The report goes back to
+    // directory order afterwards.
+    std::stable_sort(images.begin(), images.end(),
+                     [](const Image& a, const Image& b) { return a.pixels > b.pixels; });
+
+    // Sized from the header probe so the image can wait for budget before it is decoded.
+    auto image_bytes = [&](size_t i) { return images[i].pixels * (3 + output_channels); };
+
+    auto load = [&](size_t i) {
+        Image& img = images[i];
         auto host_start = std::chrono::high_resolution_clock::now();
         int w, h, c;
-        img.input_host = stbi_load(entry.path().c_str(), &w, &h, &c, 3);
+        img.input_host = stbi_load(img.path.c_str(), &w, &h, &c, 3);
         auto host_stop = std::chrono::high_resolution_clock::now();
         img.time_load_ms = std::chrono::duration<float, std::milli>(host_stop - host_start).count();
         if (!img.input_host) {
-            std::cerr << "Failed to load " << entry.path() << "\n";
-            continue;
+            std::cerr << "Failed to load " << img.path << "\n";
+            return false;
         }
         img.width = w; img.height = h; img.channels_in = 3;
         img.channels_out = output_channels;
         size_t output_size = (size_t)w * h * img.channels_out;
         img.output_host = new unsigned char[output_size];
-        images.push_back(img);
-    }
-    if (images.empty()) {
-        std::cerr << "No images found in " << folder << "\n";
-        return 1;
-    }
-
-
-    for (auto& img : images) {
+        return true;
+    };
+
+    // One job of phases per image, with the operation and border resolved here.
+    auto image_phases = [&](const Image& img) {
+        const unsigned char* in = img.input_host;
+        unsigned char* out = img.output_host;
+        const int w = img.width, h = img.height, c = img.channels_in;
+        PhaseList phases;
+        dispatch_border(border, [&](auto policy) {
+            using Border = decltype(policy);
+            if (op == "grayscale") {
+                phases = grayscale_phases(in, out, w, h, c);
+            } else if (op == "gaussian" && gaussian_impl == "iir") {
+                phases = gaussian_iir_phases<Border>(in, out, w, h, c, sigma, scratch);
+            } else if (op == "gaussian" && tile.w != 0) {
+                TileShape shape = tile.w < 0 ? auto_tile(w, h, c, gaussian.radius) : tile;
+                phases = gaussian_tiled_phases<Border>(in, out, w, h, c, gaussian, gaussian_impl == "separable",
+                                                       shape, scratch);
+            } else if (op == "gaussian" && gaussian_impl == "separable") {
+                phases = gaussian_separable_phases<Border>(in, out, w, h, c, gaussian.w1d.data(), gaussian.size(),
+                                                           scratch);
+            } else if (op == "gaussian") {
+                phases = gaussian_phases<Border>(in, out, w, h, c, gaussian.w2d.data(), gaussian.size());
+            }
+            else if (op == "box") {
+                phases = box_phases<Border>(in, out, w, h, c, box_radius, box_passes, scratch);
+            }
+            else if (op == "convolve") {
+                phases = convolve_phases<Border>(in, out, w, h, c, conv_kernel, conv_fft, scratch);
+            }
+            else if (op == "sobel") {
+                phases = sobel_phases<Border>(in, out, w, h, c, sobel_norm, scratch);
+            }
+        });
+        return phases;
+    };
+
+    // Every image that is ready goes into one scheduler run: small images stay whole
+    // tasks, large ones split into row blocks or tiles, and idle threads steal
+    // whichever is left. The batch's time is split over its images by pixel count,
+    // so total_processing_time stays the wall time of the compute stage.
+    auto process = [&](const std::vector<size_t>& batch) {
         auto cpu_start = std::chrono::high_resolution_clock::now();
-        if (op == "grayscale") {
-            apply_grayscale(img.input_host, img.output_host, img.width, img.height, img.channels_in);
-        } else if (op == "gaussian") {
-            apply_gaussian(img.input_host, img.output_host, img.width, img.height, img.channels_in,
-                           GAUSSIAN_9x9, KERNEL_SIZE_GAUSSIAN);
-        }
-        else if (op == "sobel") {
-
-            size_t gray_size = (size_t)img.width * img.height * 1;
-            unsigned char* gray_buffer = new unsigned char[gray_size];
-            apply_grayscale(img.input_host, gray_buffer, img.width, img.height, img.channels_in);
-
-            // STEP 3: Apply Sobel to the 1-channel grayscale buffer.
-            apply_sobel_on_gray(gray_buffer, img.output_host, img.width, img.height,
-                                sobel_x, sobel_y, KERNEL_SIZE_SOBEL);
-
-            delete[] gray_buffer;
-        }
+        size_t batch_pixels = 0;
+        for (size_t i : batch) batch_pixels += (size_t)images[i].width * images[i].height;
+        const size_t grain = task_grain(batch_pixels, threads);
+        for (size_t j = 0; j < batch.size(); ++j)
+            spawn_phase(scheduler, (int)(j % threads),
+                        std::make_shared<const PhaseList>(image_phases(images[batch[j]])), 0, grain);
+        #pragma omp parallel num_threads(threads)
+        scheduler.work(omp_get_thread_num());
         auto cpu_stop = std::chrono::high_resolution_clock::now();
-        img.time_process_ms = std::chrono::duration<float, std::milli>(cpu_stop - cpu_start).count();
-    }
+        const float batch_ms = std::chrono::duration<float, std::milli>(cpu_stop - cpu_start).count();
+        for (size_t i : batch)
+            images[i].time_process_ms = batch_ms * ((float)images[i].width * images[i].height / batch_pixels);
+    };
+
+    auto save = [&](size_t i) {
+        Image& img = images[i];
+        std::string outPath = (fs::path(output_folder) / (img.name + "_" + op + ".png")).string();
+        int stride = img.width * img.channels_out;
+        auto host_start = std::chrono::high_resolution_clock::now();
+        stbi_write_png(outPath.c_str(), img.width, img.height,
+                       img.channels_out, img.output_host, stride);
+        auto host_stop = std::chrono::high_resolution_clock::now();
+        img.time_save_ms = std::chrono::duration<float, std::milli>(host_stop - host_start).count();
+        stbi_image_free(img.input_host);
+        delete[] img.output_host;
+        img.input_host = nullptr;
+        img.output_host = nullptr;
+    };
 
+    // The OpenMP team runs on this thread while the --io-threads pool decodes
+    // upcoming images and writes finished ones.
+    PipelineStats stats = run_pipeline_batched(images.size(), limits, image_bytes, load, process, save);
 
-    std::vector<std::thread> save_threads;
-    for (auto& img : images) {
-        save_threads.emplace_back([&img, output_folder, op]() {
-            std::string outPath = (fs::path(output_folder) / (img.name + "_" + op + ".png")).string();
-            int stride = img.width * img.channels_out;
-            auto host_start = std::chrono::high_resolution_clock::now();
-            stbi_write_png(outPath.c_str(), img.width, img.height,
-                           img.channels_out, img.output_host, stride);
-            auto host_stop = std::chrono::high_resolution_clock::now();
-            img.time_save_ms = std::chrono::duration<float, std::milli>(host_stop - host_start).count();
-            stbi_image_free(img.input_host);
-            delete[] img.output_host;
-            img.input_host = nullptr;
-            img.output_host = nullptr;
-        });
-    }
-    for (auto& t : save_threads) { t.join(); }
+    // Files that failed to decode are left out of the report.
+    images.erase(std::remove_if(images.begin(), images.end(), [](const Image& img) { return img.width == 0; }),
+                 images.end());
+    std::sort(images.begin(), images.end(), [](const Image& a, const Image& b) { return a.listed < b.listed; });
 
 
     float total_load_ms = 0.0f;
@@ -246,6 +550,7 @@ int main(int argc, char** argv)
     std::cout << "  \"total_loading_time\": " << total_load_ms << ",\n";
     std::cout << "  \"total_processing_time\": " << total_process_ms << ",\n";
     std::cout << "  \"total_exporting_time\": " << total_export_ms << ",\n";
+    std::cout << "  \"total_exporting_wall_time\": " << stats.export_wall_ms << ",\n";
     std::cout << "  \"individual_image_times\": [\n";
 
     for (size_t i = 0; i < images.size(); ++i) {
@@ -270,6 +575,7 @@ int main(int argc, char** argv)
     json_file << "  \"total_loading_time\": " << total_load_ms << ",\n";
     json_file << "  \"total_processing_time\": " << total_process_ms << ",\n";
     json_file << "  \"total_exporting_time\": " << total_export_ms << ",\n";
+    json_file << "  \"total_exporting_wall_time\": " << stats.export_wall_ms << ",\n";
     json_file << "  \"individual_image_times\": [\n";
 
     for (size_t i = 0; i < images.size(); ++i) {
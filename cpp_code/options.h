@@ -0,0 +1,53 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#include <map>
+#include <string>
+#include <stdexcept>
+
+// Optional "--key=value" (or bare "--flag") arguments that follow the
+// positional <input> <output> <operation> arguments of every engine.
+struct Options {
+    std::map<std::string, std::string> values;
+
+    bool has(const std::string& key) const { return values.count(key) != 0; }
+
+    std::string get(const std::string& key, const std::string& def) const {
+        auto it = values.find(key);
+        return it == values.end() ? def : it->second;
+    }
+
+    int get_int(const std::string& key, int def) const {
+        auto it = values.find(key);
+        if (it == values.end()) return def;
+        size_t used = 0;
+        int v = 0;
+        try { v = std::stoi(it->second, &used); } catch (const std::exception&) { used = 0; }
+        if (used == 0 || used != it->second.size()) throw std::invalid_argument("--" + key + " expects an integer");
+        return v;
+    }
+
+    float get_float(const std::string& key, float def) const {
+        auto it = values.find(key);
+        if (it == values.end()) return def;
+        size_t used = 0;
+        float v = 0.0f;
+        try { v = std::stof(it->second, &used); } catch (const std::exception&) { used = 0; }
+        if (used == 0 || used != it->second.size()) throw std::invalid_argument("--" + key + " expects a number");
+        return v;
+    }
+};
+
+inline Options parse_options(int argc, char** argv, int first) {
+    Options opts;
+    for (int i = first; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--", 0) != 0) throw std::invalid_argument("Unexpected argument: " + arg);
+        size_t eq = arg.find('=');
+        if (eq == std::string::npos) opts.values[arg.substr(2)] = "";
+        else opts.values[arg.substr(2, eq - 2)] = arg.substr(eq + 1);
+    }
+    return opts;
+}
+
+#endif
@@ -0,0 +1,241 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "options.h"
+
+// Streaming load -> process -> save for the batch engines. Each image is decoded
+// just ahead of the compute stage and freed as soon as it has been written, so
+// peak memory follows --max-inflight / --max-memory instead of the batch size,
+// and decoding, processing and encoding of different images overlap.
+
+// One slot per item for the parallel decode. Loads finish in any order, but the
+// compute stage takes items strictly by index, so outputs and the timing report
+// keep directory order.
+class OrderedSlots {
+public:
+    explicit OrderedSlots(size_t n) : state_(n, PENDING) {}
+
+    void set(size_t i, bool loaded) {
+        std::lock_guard<std::mutex> lock(m_);
+        state_[i] = loaded ? LOADED : FAILED;
+        ready_.notify_all();
+    }
+
+    // Waits for item i; false if it failed to load.
+    bool wait(size_t i) {
+        std::unique_lock<std::mutex> lock(m_);
+        ready_.wait(lock, [&] { return state_[i] != PENDING; });
+        return state_[i] == LOADED;
+    }
+
+    // True once item i has loaded or failed, without waiting.
+    bool done(size_t i) {
+        std::lock_guard<std::mutex> lock(m_);
+        return state_[i] != PENDING;
+    }
+
+private:
+    enum State : unsigned char { PENDING, LOADED, FAILED };
+    std::mutex m_;
+    std::condition_variable ready_;
+    std::vector<State> state_;
+};
+
+// A fixed set of worker threads draining one task queue, so a batch of thousands
+// of images never runs more than `threads` decoder/zlib instances at once.
+class ThreadPool {
+public:
+    explicit ThreadPool(int threads) {
+        for (int t = 0; t < std::max(threads, 1); ++t) workers_.emplace_back([this] { run(); });
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(m_);
+            stopping_ = true;
+        }
+        work_.notify_all();
+        for (auto& t : workers_) t.join();
+    }
+
+    void submit(std::function<void()> task) {
+        std::lock_guard<std::mutex> lock(m_);
+        tasks_.push_back(std::move(task));
+        work_.notify_one();
+    }
+
+    // Waits until every submitted task has finished.
+    void wait() {
+        std::unique_lock<std::mutex> lock(m_);
+        idle_.wait(lock, [&] { return tasks_.empty() && active_ == 0; });
+    }
+
+private:
+    void run() {
+        for (;;) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(m_);
+                work_.wait(lock, [&] { return stopping_ || !tasks_.empty(); });
+                if (tasks_.empty()) return;
+                task = std::move(tasks_.front());
+                tasks_.pop_front();
+                ++active_;
+            }
+            task();
+            std::lock_guard<std::mutex> lock(m_);
+            if (--active_ == 0 && tasks_.empty()) idle_.notify_all();
+        }
+    }
+
+    std::mutex m_;
+    std::condition_variable work_, idle_;
+    std::deque<std::function<void()>> tasks_;
+    std::vector<std::thread> workers_;
+    int active_ = 0;
+    bool stopping_ = false;
+};
+
+// Admission control for images in flight (decoded but not yet written). An image
+// that alone is over max_bytes still goes through once nothing else is in flight.
+class InflightBudget {
+public:
+    InflightBudget(int max_images, size_t max_bytes) : max_images_(max_images), max_bytes_(max_bytes) {}
+
+    void acquire(size_t bytes) {
+        std::unique_lock<std::mutex> lock(m_);
+        freed_.wait(lock, [&] {
+            return images_ == 0 || (images_ < max_images_ && (max_bytes_ == 0 || bytes_ + bytes <= max_bytes_));
+        });
+        ++images_;
+        bytes_ += bytes;
+    }
+
+    void release(size_t bytes) {
+        std::lock_guard<std::mutex> lock(m_);
+        --images_;
+        bytes_ -= bytes;
+        freed_.notify_all();
+    }
+
+private:
+    std::mutex m_;
+    std::condition_variable freed_;
+    int max_images_, images_ = 0;
+    size_t max_bytes_, bytes_ = 0;
+};
+
+struct PipelineLimits {
+    int max_inflight = 4;
+    size_t max_memory = 0;  // bytes of pixel buffers, 0 for no limit
+    int io_threads = 1;     // ThreadPool size for decoding and PNG export
+};
+
+inline PipelineLimits pipeline_limits_from_options(const Options& opts, int default_io_threads,
+                                                   int default_inflight = 4) {
+    PipelineLimits limits;
+    limits.io_threads = opts.get_int("io-threads", default_io_threads);
+    if (limits.io_threads < 1) throw std::invalid_argument("--io-threads must be at least 1");
+    limits.max_inflight = opts.get_int("max-inflight", default_inflight);
+    if (limits.max_inflight < 1) throw std::invalid_argument("--max-inflight must be at least 1");
+    const int mb = opts.get_int("max-memory", 0);
+    if (mb < 0) throw std::invalid_argument("--max-memory must not be negative");
+    limits.max_memory = (size_t)mb << 20;
+    return limits;
+}
+
+// Wall-clock time with at least one export running. Exports overlap each other
+// and the other stages, so this is usually well below the per-image sum.
+struct PipelineStats {
+    double export_wall_ms = 0.0;
+};
+
+// Runs items 0 .. n-1 through the three stages. bytes(i) estimates the buffers item
+// i will hold (from the file header) before it is admitted; load(i) and save(i) run
+// on a pool of limits.io_threads workers, load returning false to drop the item and
+// save freeing its buffers; process(batch) runs on the calling thread in index order,
+// so OpenMP regions and CUDA calls stay where they were. A batch is the next item
+// plus up to max_batch - 1 later ones that have already loaded, so an engine can
+// schedule several images together; run_pipeline hands out one item at a time.
+template <class Bytes, class Load, class ProcessBatch, class Save>
+PipelineStats run_pipeline_batched(size_t n, const PipelineLimits& limits, Bytes bytes, Load load,
+                                   ProcessBatch process, Save save, size_t max_batch = SIZE_MAX)
+{
+    using Clock = std::chrono::steady_clock;
+    InflightBudget budget(limits.max_inflight, limits.max_memory);
+    OrderedSlots slots(n);
+    std::vector<size_t> admitted(n);
+
+    PipelineStats stats;
+    std::mutex clock_m;
+    int exporting = 0;
+    Clock::time_point busy_since;
+
+    // Declared last so its workers are joined before anything they reference goes away.
+    ThreadPool io(limits.io_threads);
+
+    // Admission runs in index order, so the item the compute stage waits for next is
+    // always already admitted and queued ahead of later ones.
+    std::thread admit([&] {
+        for (size_t i = 0; i < n; ++i) {
+            admitted[i] = bytes(i);
+            budget.acquire(admitted[i]);
+            io.submit([&, i] {
+                const bool ok = load(i);
+                if (!ok) budget.release(admitted[i]);
+                slots.set(i, ok);
+            });
+        }
+    });
+
+    std::vector<size_t> batch;
+    for (size_t next = 0; next < n;) {
+        batch.clear();
+        if (slots.wait(next)) batch.push_back(next);
+        for (++next; next < n && batch.size() < max_batch && slots.done(next); ++next)
+            if (slots.wait(next)) batch.push_back(next);
+        if (batch.empty()) continue;
+        const std::vector<size_t>& ready = batch;
+        process(ready);
+        for (size_t i : batch) io.submit([&, i] {
+            {
+                std::lock_guard<std::mutex> lock(clock_m);
+                if (exporting++ == 0) busy_since = Clock::now();
+            }
+            save(i);
+            {
+                std::lock_guard<std::mutex> lock(clock_m);
+                if (--exporting == 0)
+                    stats.export_wall_ms += std::chrono::duration<double, std::milli>(Clock::now() - busy_since).count();
+            }
+            budget.release(admitted[i]);
+        });
+    }
+
+    admit.join();
+    io.wait();
+    return stats;
+}
+
+template <class Bytes, class Load, class Process, class Save>
+PipelineStats run_pipeline(size_t n, const PipelineLimits& limits, Bytes bytes, Load load, Process process, Save save)
+{
+    return run_pipeline_batched(n, limits, bytes, load, [&](const std::vector<size_t>& batch) {
+        for (size_t i : batch) process(i);
+    }, save, 1);
+}
+
+#endif
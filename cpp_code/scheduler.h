@@ -0,0 +1,125 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing scheduler for the OpenMP engine. Every thread of a parallel region
+// runs work(id): it pops tasks from the back of its own deque and, when that is
+// empty, steals from the front of the others. A batch of images becomes one pool
+// of tasks, so threads that finish their thumbnails move on to tiles of the large
+// image instead of waiting at a per-image barrier.
+
+class WorkStealingScheduler {
+public:
+    using Task = std::function<void(int worker)>;
+
+    explicit WorkStealingScheduler(int workers) {
+        for (int i = 0; i < std::max(workers, 1); ++i) deques_.push_back(std::make_unique<Deque>());
+    }
+
+    int workers() const { return (int)deques_.size(); }
+
+    // Queues a task on worker's deque; from inside a task, pass the running worker.
+    void spawn(int worker, Task task) {
+        pending_.fetch_add(1);
+        Deque& d = *deques_[worker % deques_.size()];
+        std::lock_guard<std::mutex> lock(d.m);
+        d.tasks.push_back(std::move(task));
+    }
+
+    // Runs tasks as worker `id` until every spawned task, including those spawned
+    // while running, has finished.
+    void work(int id) {
+        const int n = workers();
+        Task task;
+        while (pending_.load() > 0) {
+            bool found = pop_back(id, task);
+            for (int k = 1; k < n && !found; ++k) found = steal_front((id + k) % n, task);
+            if (!found) {
+                std::this_thread::yield();
+                continue;
+            }
+            task(id);
+            task = nullptr;
+            pending_.fetch_sub(1);
+        }
+    }
+
+private:
+    struct Deque {
+        std::mutex m;
+        std::deque<Task> tasks;
+    };
+
+    bool pop_back(int id, Task& task) {
+        Deque& d = *deques_[id];
+        std::lock_guard<std::mutex> lock(d.m);
+        if (d.tasks.empty()) return false;
+        task = std::move(d.tasks.back());
+        d.tasks.pop_back();
+        return true;
+    }
+
+    bool steal_front(int victim, Task& task) {
+        Deque& d = *deques_[victim];
+        std::lock_guard<std::mutex> lock(d.m);
+        if (d.tasks.empty()) return false;
+        task = std::move(d.tasks.front());
+        d.tasks.pop_front();
+        return true;
+    }
+
+    std::vector<std::unique_ptr<Deque>> deques_;
+    std::atomic<long> pending_{0};
+};
+
+// One step of an image's work: `units` independent pieces (rows, tiles, column
+// strips) of about unit_pixels each, run a range at a time as run(u0, u1, worker).
+// The phases of an image run in order; the units within a phase in any order.
+struct Phase {
+    int units;
+    size_t unit_pixels;
+    std::function<void(int u0, int u1, int worker)> run;
+};
+
+using PhaseList = std::vector<Phase>;
+
+// Pixels per task for a batch: enough tasks for every thread to steal from, but
+// no smaller than a thumbnail, so small images stay a single task per phase.
+inline size_t task_grain(size_t batch_pixels, int threads) {
+    constexpr size_t MIN_GRAIN = 1 << 14, MAX_GRAIN = 1 << 18;
+    return std::clamp(batch_pixels / (8 * (size_t)std::max(threads, 1)), MIN_GRAIN, MAX_GRAIN);
+}
+
+// Spawns phase p of a job onto worker's deque, its units grouped into tasks of
+// about `grain` pixels. The task that finishes a phase's last group spawns the
+// next phase from the worker it ran on, so a one-task image runs start to finish
+// on one thread.
+inline void spawn_phase(WorkStealingScheduler& sched, int worker, std::shared_ptr<const PhaseList> phases,
+                        size_t p, size_t grain)
+{
+    for (; p < phases->size() && (*phases)[p].units <= 0; ++p) {}
+    if (p >= phases->size()) return;
+    const Phase& phase = (*phases)[p];
+    const int per = (int)std::max<size_t>(1, grain / std::max<size_t>(phase.unit_pixels, 1));
+    const int groups = (phase.units + per - 1) / per;
+    auto left = std::make_shared<std::atomic<int>>(groups);
+    // Pushed last-first so the owner, popping from the back, starts at the top.
+    for (int g = groups - 1; g >= 0; --g) {
+        sched.spawn(worker, [&sched, phases, p, grain, per, g, left](int w) {
+            const Phase& ph = (*phases)[p];
+            ph.run(g * per, std::min(ph.units, (g + 1) * per), w);
+            if (left->fetch_sub(1) == 1) spawn_phase(sched, w, phases, p + 1, grain);
+        });
+    }
+}
+
+#endif
@@ -0,0 +1,428 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <cmath>
+#include <algorithm>
+
+#include "border.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMD_X86 1
+#endif
+
+// Vectorized pixel kernels. Each kernel is compiled for several instruction sets
+// with per-function target attributes, so the binaries still run on any x86-64 CPU;
+// the widest variant the CPU supports is picked at runtime.
+
+enum class SimdLevel { Scalar = 0, SSE41 = 1, AVX2 = 2, AVX512 = 3 };
+
+inline const char* simd_level_name(SimdLevel level) {
+    switch (level) {
+        case SimdLevel::AVX512: return "avx512";
+        case SimdLevel::AVX2: return "avx2";
+        case SimdLevel::SSE41: return "sse4.1";
+        default: return "scalar";
+    }
+}
+
+inline SimdLevel detect_simd_level() {
+#ifdef SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) return SimdLevel::AVX512;
+    if (__builtin_cpu_supports("avx2")) return SimdLevel::AVX2;
+    if (__builtin_cpu_supports("sse4.1")) return SimdLevel::SSE41;
+#endif
+    return SimdLevel::Scalar;
+}
+
+inline SimdLevel& simd_level() {
+    static SimdLevel level = detect_simd_level();
+    return level;
+}
+
+// Handles --simd=auto|avx512|avx2|sse4.1|scalar. A level above what the CPU
+// supports is clamped down to the detected one. Call before starting any threads.
+inline bool set_simd_level(const std::string& name) {
+    SimdLevel detected = detect_simd_level();
+    SimdLevel wanted;
+    if (name == "auto") wanted = detected;
+    else if (name == "avx512") wanted = SimdLevel::AVX512;
+    else if (name == "avx2") wanted = SimdLevel::AVX2;
+    else if (name == "sse4.1") wanted = SimdLevel::SSE41;
+    else if (name == "scalar") wanted = SimdLevel::Scalar;
+    else return false;
+    simd_level() = wanted < detected ? wanted : detected;
+    return true;
+}
+
+// ---------------------------------------------------------------------------
+// Grayscale: Y = (77 R + 150 G + 29 B + 128) >> 8, i.e. the 0.299/0.587/0.114
+// weights in 8.8 fixed point. The sum fits in an unsigned 16-bit lane, so the
+// vector paths widen bytes to 16 bits and never need 32-bit arithmetic. All
+// paths produce identical output.
+// ---------------------------------------------------------------------------
+
+constexpr int GRAY_WR = 77, GRAY_WG = 150, GRAY_WB = 29;
+
+inline unsigned char rgb_to_gray(unsigned char r, unsigned char g, unsigned char b) {
+    return static_cast<unsigned char>((GRAY_WR * r + GRAY_WG * g + GRAY_WB * b + 128) >> 8);
+}
+
+inline void rgb_to_gray_row_scalar(const unsigned char* rgb, unsigned char* gray, size_t n) {
+    for (size_t i = 0; i < n; ++i)
+        gray[i] = rgb_to_gray(rgb[3 * i], rgb[3 * i + 1], rgb[3 * i + 2]);
+}
+
+#ifdef SIMD_X86
+namespace simd_detail {
+
+// pshufb masks that pull channel `ch` of 16 interleaved RGB pixels out of the
+// three 16-byte vectors holding them. m[ch][src][i] selects byte 3*i+ch if it
+// lives in vector `src`, otherwise zeroes the lane so the three results can be OR-ed.
+struct DeinterleaveMasks { signed char m[3][3][16]; };
+
+constexpr DeinterleaveMasks make_deinterleave_masks() {
+    DeinterleaveMasks t{};
+    for (int ch = 0; ch < 3; ++ch)
+        for (int src = 0; src < 3; ++src)
+            for (int i = 0; i < 16; ++i) {
+                int p = 3 * i + ch;
+                t.m[ch][src][i] = static_cast<signed char>(p / 16 == src ? p % 16 : -128);
+            }
+    return t;
+}
+
+alignas(16) inline constexpr DeinterleaveMasks RGB_MASKS = make_deinterleave_masks();
+
+__attribute__((target("sse4.1")))
+inline __m128i mask128(int ch, int src) {
+    return _mm_load_si128(reinterpret_cast<const __m128i*>(RGB_MASKS.m[ch][src]));
+}
+
+__attribute__((target("sse4.1")))
+inline __m128i gray16_sse41(__m128i r, __m128i g, __m128i b) {
+    __m128i y = _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(GRAY_WR)),
+                              _mm_mullo_epi16(g, _mm_set1_epi16(GRAY_WG)));
+    y = _mm_add_epi16(y, _mm_mullo_epi16(b, _mm_set1_epi16(GRAY_WB)));
+    return _mm_srli_epi16(_mm_add_epi16(y, _mm_set1_epi16(128)), 8);
+}
+
+__attribute__((target("avx2")))
+inline __m256i gray16_avx2(__m256i r, __m256i g, __m256i b) {
+    __m256i y = _mm256_add_epi16(_mm256_mullo_epi16(r, _mm256_set1_epi16(GRAY_WR)),
+                                 _mm256_mullo_epi16(g, _mm256_set1_epi16(GRAY_WG)));
+    y = _mm256_add_epi16(y, _mm256_mullo_epi16(b, _mm256_set1_epi16(GRAY_WB)));
+    return _mm256_srli_epi16(_mm256_add_epi16(y, _mm256_set1_epi16(128)), 8);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+inline __m512i gray16_avx512(__m512i r, __m512i g, __m512i b) {
+    __m512i y = _mm512_add_epi16(_mm512_mullo_epi16(r, _mm512_set1_epi16(GRAY_WR)),
+                                 _mm512_mullo_epi16(g, _mm512_set1_epi16(GRAY_WG)));
+    y = _mm512_add_epi16(y, _mm512_mullo_epi16(b, _mm512_set1_epi16(GRAY_WB)));
+    return _mm512_srli_epi16(_mm512_add_epi16(y, _mm512_set1_epi16(128)), 8);
+}
+
+} // namespace simd_detail
+
+// 16 pixels (48 bytes) per iteration.
+__attribute__((target("sse4.1")))
+inline void rgb_to_gray_row_sse41(const unsigned char* rgb, unsigned char* gray, size_t n) {
+    using namespace simd_detail;
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const unsigned char* p = rgb + 3 * i;
+        __m128i v0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        __m128i v1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 16));
+        __m128i v2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 32));
+        __m128i ch[3];
+        for (int c = 0; c < 3; ++c)
+            ch[c] = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(v0, mask128(c, 0)),
+                                              _mm_shuffle_epi8(v1, mask128(c, 1))),
+                                 _mm_shuffle_epi8(v2, mask128(c, 2)));
+        __m128i lo = gray16_sse41(_mm_unpacklo_epi8(ch[0], zero), _mm_unpacklo_epi8(ch[1], zero),
+                                  _mm_unpacklo_epi8(ch[2], zero));
+        __m128i hi = gray16_sse41(_mm_unpackhi_epi8(ch[0], zero), _mm_unpackhi_epi8(ch[1], zero),
+                                  _mm_unpackhi_epi8(ch[2], zero));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(gray + i), _mm_packus_epi16(lo, hi));
+    }
+    rgb_to_gray_row_scalar(rgb + 3 * i, gray + i, n - i);
+}
+
+// 32 pixels per iteration. Each 128-bit lane holds 16 consecutive pixels, so the
+// in-lane shuffles, unpacks and packs of AVX2 keep the pixel order intact.
+__attribute__((target("avx2")))
+inline void rgb_to_gray_row_avx2(const unsigned char* rgb, unsigned char* gray, size_t n) {
+    using namespace simd_detail;
+    const __m256i zero = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        const unsigned char* p = rgb + 3 * i;
+        __m256i v[3];
+        for (int s = 0; s < 3; ++s)
+            v[s] = _mm256_inserti128_si256(
+                _mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 16 * s))),
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 48 + 16 * s)), 1);
+        __m256i ch[3];
+        for (int c = 0; c < 3; ++c) {
+            ch[c] = _mm256_shuffle_epi8(v[0], _mm256_broadcastsi128_si256(mask128(c, 0)));
+            ch[c] = _mm256_or_si256(ch[c], _mm256_shuffle_epi8(v[1], _mm256_broadcastsi128_si256(mask128(c, 1))));
+            ch[c] = _mm256_or_si256(ch[c], _mm256_shuffle_epi8(v[2], _mm256_broadcastsi128_si256(mask128(c, 2))));
+        }
+        __m256i lo = gray16_avx2(_mm256_unpacklo_epi8(ch[0], zero), _mm256_unpacklo_epi8(ch[1], zero),
+                                 _mm256_unpacklo_epi8(ch[2], zero));
+        __m256i hi = gray16_avx2(_mm256_unpackhi_epi8(ch[0], zero), _mm256_unpackhi_epi8(ch[1], zero),
+                                 _mm256_unpackhi_epi8(ch[2], zero));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(gray + i), _mm256_packus_epi16(lo, hi));
+    }
+    rgb_to_gray_row_sse41(rgb + 3 * i, gray + i, n - i);
+}
+
+// 64 pixels per iteration, same lane layout as the AVX2 path.
+__attribute__((target("avx512f,avx512bw")))
+inline void rgb_to_gray_row_avx512(const unsigned char* rgb, unsigned char* gray, size_t n) {
+    using namespace simd_detail;
+    const __m512i zero = _mm512_setzero_si512();
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        const unsigned char* p = rgb + 3 * i;
+        __m512i v[3];
+        for (int s = 0; s < 3; ++s) {
+            v[s] = _mm512_castsi128_si512(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 16 * s)));
+            v[s] = _mm512_inserti32x4(v[s], _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 48 + 16 * s)), 1);
+            v[s] = _mm512_inserti32x4(v[s], _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 96 + 16 * s)), 2);
+            v[s] = _mm512_inserti32x4(v[s], _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 144 + 16 * s)), 3);
+        }
+        __m512i ch[3];
+        for (int c = 0; c < 3; ++c) {
+            ch[c] = _mm512_shuffle_epi8(v[0], _mm512_broadcast_i32x4(mask128(c, 0)));
+            ch[c] = _mm512_or_si512(ch[c], _mm512_shuffle_epi8(v[1], _mm512_broadcast_i32x4(mask128(c, 1))));
+            ch[c] = _mm512_or_si512(ch[c], _mm512_shuffle_epi8(v[2], _mm512_broadcast_i32x4(mask128(c, 2))));
+        }
+        __m512i lo = gray16_avx512(_mm512_unpacklo_epi8(ch[0], zero), _mm512_unpacklo_epi8(ch[1], zero),
+                                   _mm512_unpacklo_epi8(ch[2], zero));
+        __m512i hi = gray16_avx512(_mm512_unpackhi_epi8(ch[0], zero), _mm512_unpackhi_epi8(ch[1], zero),
+                                   _mm512_unpackhi_epi8(ch[2], zero));
+        _mm512_storeu_si512(reinterpret_cast<__m512i*>(gray + i), _mm512_packus_epi16(lo, hi));
+    }
+    rgb_to_gray_row_avx2(rgb + 3 * i, gray + i, n - i);
+}
+#endif
+
+// Converts n interleaved RGB24 pixels to 8-bit gray.
+inline void rgb_to_gray_row(const unsigned char* rgb, unsigned char* gray, size_t n) {
+#ifdef SIMD_X86
+    switch (simd_level()) {
+        case SimdLevel::AVX512: rgb_to_gray_row_avx512(rgb, gray, n); return;
+        case SimdLevel::AVX2: rgb_to_gray_row_avx2(rgb, gray, n); return;
+        case SimdLevel::SSE41: rgb_to_gray_row_sse41(rgb, gray, n); return;
+        default: break;
+    }
+#endif
+    rgb_to_gray_row_scalar(rgb, gray, n);
+}
+
+// ---------------------------------------------------------------------------
+// Sobel on 8-bit gray rows. Gx and Gy of a 3x3 Sobel stay within +-1020, so they
+// are computed exactly in int16 lanes with shifts and adds. The magnitude is
+// either the exact L2 norm (gx^2 + gy^2 via madd into int32, then a float sqrt)
+// or the cheaper |gx| + |gy| (L1) / max(|gx|, |gy|) (Linf) approximations,
+// all saturated to 255.
+// ---------------------------------------------------------------------------
+
+enum class SobelNorm { L2, L1, LInf };
+
+inline bool parse_sobel_norm(const std::string& name, SobelNorm& norm) {
+    if (name == "l2") norm = SobelNorm::L2;
+    else if (name == "l1") norm = SobelNorm::L1;
+    else if (name == "linf") norm = SobelNorm::LInf;
+    else return false;
+    return true;
+}
+
+inline unsigned char sobel_magnitude(int gx, int gy, SobelNorm norm, bool round_nearest) {
+    int ax = gx < 0 ? -gx : gx, ay = gy < 0 ? -gy : gy;
+    int m;
+    if (norm == SobelNorm::L1) m = ax + ay;
+    else if (norm == SobelNorm::LInf) m = std::max(ax, ay);
+    else {
+        float f = std::sqrt(static_cast<float>(gx * gx + gy * gy));
+        m = static_cast<int>(round_nearest ? f + 0.5f : f);
+    }
+    return static_cast<unsigned char>(std::min(m, 255));
+}
+
+// Output pixels [x0, x1) of one row, all with both x neighbours inside the row.
+inline void sobel_row_scalar(const unsigned char* above, const unsigned char* row, const unsigned char* below,
+                             unsigned char* out, int x0, int x1, SobelNorm norm, bool round_nearest) {
+    for (int x = x0; x < x1; ++x) {
+        int gx = (above[x + 1] - above[x - 1]) + 2 * (row[x + 1] - row[x - 1]) + (below[x + 1] - below[x - 1]);
+        int gy = (below[x - 1] + 2 * below[x] + below[x + 1]) - (above[x - 1] + 2 * above[x] + above[x + 1]);
+        out[x] = sobel_magnitude(gx, gy, norm, round_nearest);
+    }
+}
+
+// Output pixel x of a row whose x neighbours may fall outside [0, w).
+template <class Border>
+inline void sobel_pixel_border(const unsigned char* above, const unsigned char* row, const unsigned char* below,
+                               unsigned char* out, int w, int x, SobelNorm norm, bool round_nearest) {
+    const int l = Border::map(x - 1, w), r = Border::map(x + 1, w);
+    auto at = [](const unsigned char* p, int i) { return i < 0 ? 0 : p[i]; };
+    int gx = (at(above, r) - at(above, l)) + 2 * (at(row, r) - at(row, l)) + (at(below, r) - at(below, l));
+    int gy = (at(below, l) + 2 * below[x] + at(below, r)) - (at(above, l) + 2 * above[x] + at(above, r));
+    out[x] = sobel_magnitude(gx, gy, norm, round_nearest);
+}
+
+#ifdef SIMD_X86
+namespace simd_detail {
+
+// Gx / Gy from the eight neighbours (above l/c/r, row l/r, below l/c/r), already
+// widened to int16. P is the intrinsic prefix (_mm, _mm256, _mm512).
+#define SOBEL_GRADIENTS(P, a_l, a_c, a_r, r_l, r_r, b_l, b_c, b_r, gx, gy)                        \
+    gx = P##_add_epi16(P##_add_epi16(P##_sub_epi16(a_r, a_l), P##_sub_epi16(b_r, b_l)),         \
+                       P##_slli_epi16(P##_sub_epi16(r_r, r_l), 1));                             \
+    gy = P##_sub_epi16(P##_add_epi16(P##_add_epi16(b_l, b_r), P##_slli_epi16(b_c, 1)),          \
+                       P##_add_epi16(P##_add_epi16(a_l, a_r), P##_slli_epi16(a_c, 1)));
+
+__attribute__((target("sse4.1")))
+inline __m128i sobel_mag16_sse41(__m128i gx, __m128i gy, SobelNorm norm, bool round_nearest) {
+    if (norm == SobelNorm::L1) return _mm_adds_epu16(_mm_abs_epi16(gx), _mm_abs_epi16(gy));
+    if (norm == SobelNorm::LInf) return _mm_max_epi16(_mm_abs_epi16(gx), _mm_abs_epi16(gy));
+    __m128i lo = _mm_unpacklo_epi16(gx, gy), hi = _mm_unpackhi_epi16(gx, gy);
+    __m128 flo = _mm_sqrt_ps(_mm_cvtepi32_ps(_mm_madd_epi16(lo, lo)));
+    __m128 fhi = _mm_sqrt_ps(_mm_cvtepi32_ps(_mm_madd_epi16(hi, hi)));
+    __m128i ilo = round_nearest ? _mm_cvtps_epi32(flo) : _mm_cvttps_epi32(flo);
+    __m128i ihi = round_nearest ? _mm_cvtps_epi32(fhi) : _mm_cvttps_epi32(fhi);
+    return _mm_packs_epi32(ilo, ihi);
+}
+
+__attribute__((target("avx2")))
+inline __m256i sobel_mag16_avx2(__m256i gx, __m256i gy, SobelNorm norm, bool round_nearest) {
+    if (norm == SobelNorm::L1) return _mm256_adds_epu16(_mm256_abs_epi16(gx), _mm256_abs_epi16(gy));
+    if (norm == SobelNorm::LInf) return _mm256_max_epi16(_mm256_abs_epi16(gx), _mm256_abs_epi16(gy));
+    // unpack/pack are both in-lane, so the pixel order survives the round trip.
+    __m256i lo = _mm256_unpacklo_epi16(gx, gy), hi = _mm256_unpackhi_epi16(gx, gy);
+    __m256 flo = _mm256_sqrt_ps(_mm256_cvtepi32_ps(_mm256_madd_epi16(lo, lo)));
+    __m256 fhi = _mm256_sqrt_ps(_mm256_cvtepi32_ps(_mm256_madd_epi16(hi, hi)));
+    __m256i ilo = round_nearest ? _mm256_cvtps_epi32(flo) : _mm256_cvttps_epi32(flo);
+    __m256i ihi = round_nearest ? _mm256_cvtps_epi32(fhi) : _mm256_cvttps_epi32(fhi);
+    return _mm256_packs_epi32(ilo, ihi);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+inline __m512i sobel_mag16_avx512(__m512i gx, __m512i gy, SobelNorm norm, bool round_nearest) {
+    if (norm == SobelNorm::L1) return _mm512_adds_epu16(_mm512_abs_epi16(gx), _mm512_abs_epi16(gy));
+    if (norm == SobelNorm::LInf) return _mm512_max_epi16(_mm512_abs_epi16(gx), _mm512_abs_epi16(gy));
+    __m512i lo = _mm512_unpacklo_epi16(gx, gy), hi = _mm512_unpackhi_epi16(gx, gy);
+    __m512 flo = _mm512_sqrt_ps(_mm512_cvtepi32_ps(_mm512_madd_epi16(lo, lo)));
+    __m512 fhi = _mm512_sqrt_ps(_mm512_cvtepi32_ps(_mm512_madd_epi16(hi, hi)));
+    __m512i ilo = round_nearest ? _mm512_cvtps_epi32(flo) : _mm512_cvttps_epi32(flo);
+    __m512i ihi = round_nearest ? _mm512_cvtps_epi32(fhi) : _mm512_cvttps_epi32(fhi);
+    return _mm512_packs_epi32(ilo, ihi);
+}
+
+} // namespace simd_detail
+
+// 16 pixels per iteration (two halves of 8 int16 lanes).
+__attribute__((target("sse4.1")))
+inline int sobel_row_sse41(const unsigned char* above, const unsigned char* row, const unsigned char* below,
+                           unsigned char* out, int x, int x_end, SobelNorm norm, bool round_nearest) {
+    using namespace simd_detail;
+    const __m128i zero = _mm_setzero_si128();
+    for (; x + 16 <= x_end; x += 16) {
+        const unsigned char* src[8] = {above + x - 1, above + x, above + x + 1, row + x - 1,
+                                       row + x + 1, below + x - 1, below + x, below + x + 1};
+        __m128i v[8];
+        for (int i = 0; i < 8; ++i) v[i] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src[i]));
+        __m128i lo[8], hi[8];
+        for (int i = 0; i < 8; ++i) { lo[i] = _mm_unpacklo_epi8(v[i], zero); hi[i] = _mm_unpackhi_epi8(v[i], zero); }
+        __m128i gx, gy;
+        SOBEL_GRADIENTS(_mm, lo[0], lo[1], lo[2], lo[3], lo[4], lo[5], lo[6], lo[7], gx, gy)
+        __m128i m_lo = sobel_mag16_sse41(gx, gy, norm, round_nearest);
+        SOBEL_GRADIENTS(_mm, hi[0], hi[1], hi[2], hi[3], hi[4], hi[5], hi[6], hi[7], gx, gy)
+        __m128i m_hi = sobel_mag16_sse41(gx, gy, norm, round_nearest);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + x), _mm_packus_epi16(m_lo, m_hi));
+    }
+    return x;
+}
+
+// 16 pixels per iteration in one 256-bit vector of int16.
+__attribute__((target("avx2")))
+inline int sobel_row_avx2(const unsigned char* above, const unsigned char* row, const unsigned char* below,
+                          unsigned char* out, int x, int x_end, SobelNorm norm, bool round_nearest) {
+    using namespace simd_detail;
+    for (; x + 16 <= x_end; x += 16) {
+        const unsigned char* src[8] = {above + x - 1, above + x, above + x + 1, row + x - 1,
+                                       row + x + 1, below + x - 1, below + x, below + x + 1};
+        __m256i v[8];
+        for (int i = 0; i < 8; ++i)
+            v[i] = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src[i])));
+        __m256i gx, gy;
+        SOBEL_GRADIENTS(_mm256, v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7], gx, gy)
+        __m256i m = sobel_mag16_avx2(gx, gy, norm, round_nearest);
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(m, m), 0x08);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + x), _mm256_castsi256_si128(packed));
+    }
+    return x;
+}
+
+// 32 pixels per iteration in one 512-bit vector of int16.
+__attribute__((target("avx512f,avx512bw")))
+inline int sobel_row_avx512(const unsigned char* above, const unsigned char* row, const unsigned char* below,
+                            unsigned char* out, int x, int x_end, SobelNorm norm, bool round_nearest) {
+    using namespace simd_detail;
+    for (; x + 32 <= x_end; x += 32) {
+        const unsigned char* src[8] = {above + x - 1, above + x, above + x + 1, row + x - 1,
+                                       row + x + 1, below + x - 1, below + x, below + x + 1};
+        __m512i v[8];
+        for (int i = 0; i < 8; ++i)
+            v[i] = _mm512_cvtepu8_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(src[i])));
+        __m512i gx, gy;
+        SOBEL_GRADIENTS(_mm512, v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7], gx, gy)
+        __m512i m = sobel_mag16_avx512(gx, gy, norm, round_nearest);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + x), _mm512_cvtusepi16_epi8(m));
+    }
+    return x;
+}
+
+#undef SOBEL_GRADIENTS
+#endif
+
+// Sobel magnitude for pixels [x0, x1) of a row whose x neighbours are all readable
+// (x0 - 1 and x1 included), so there is no border logic: the interior of an image
+// row, or a row of a tile with a halo.
+inline void sobel_span(const unsigned char* above, const unsigned char* row, const unsigned char* below,
+                       unsigned char* out, int x0, int x1, SobelNorm norm, bool round_nearest) {
+    int x = x0;
+#ifdef SIMD_X86
+    // Vectors read up to x + width, so stop before they would pass pixel x1.
+    switch (simd_level()) {
+        case SimdLevel::AVX512: x = sobel_row_avx512(above, row, below, out, x, x1, norm, round_nearest);
+                                x = sobel_row_avx2(above, row, below, out, x, x1, norm, round_nearest); break;
+        case SimdLevel::AVX2: x = sobel_row_avx2(above, row, below, out, x, x1, norm, round_nearest); break;
+        case SimdLevel::SSE41: x = sobel_row_sse41(above, row, below, out, x, x1, norm, round_nearest); break;
+        default: break;
+    }
+#endif
+    sobel_row_scalar(above, row, below, out, x, x1, norm, round_nearest);
+}
+
+// Sobel magnitude for one output row of width w, given the gray rows above, at and
+// below it (the caller resolves rows outside the image). The first and last pixel
+// resolve their x neighbours through Border; everything in between runs through
+// the vector path.
+template <class Border = BorderClamp>
+inline void sobel_row(const unsigned char* above, const unsigned char* row, const unsigned char* below,
+                      unsigned char* out, int w, SobelNorm norm, bool round_nearest) {
+    sobel_pixel_border<Border>(above, row, below, out, w, 0, norm, round_nearest);
+    if (w == 1) return;
+    sobel_span(above, row, below, out, 1, w - 1, norm, round_nearest);
+    sobel_pixel_border<Border>(above, row, below, out, w, w - 1, norm, round_nearest);
+}
+
+#endif